@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""Turn an event dump of mm.c back into a trace that mdriver can replay.
+
+mm.c built with EVENTS keeps the last calls of every thread in a ring and
+writes them out with mm_events_dump(), see mm.h for the layout.  Events of
+all threads are merged by their timestamp and each block gets a trace id
+when it is allocated, which it keeps across reallocs until it is freed.
+
+  ./mdriver -E events.bin -f traces/amptjp.rep
+  ./decode-events.py events.bin > amptjp-events.rep
+
+Once a ring wraps around, blocks allocated before its oldest event are
+unknown: their frees are dropped and reallocs of them become mallocs.
+Calls that failed are dropped too.
+"""
+
+import argparse
+import struct
+import sys
+
+MM_EVENTS_MAGIC = 0x56454d4d
+EVENT = struct.Struct('<QQQQIHBB')
+HEADER = struct.Struct('<II')
+
+MM_EV_MALLOC, MM_EV_FREE, MM_EV_REALLOC, MM_EV_MEMALIGN, MM_EV_RESIZE = \
+    range(1, 6)
+OP_NAMES = ['?', 'malloc', 'free', 'realloc', 'memalign', 'resize']
+PATH_NAMES = ['-', 'fit', 'extend', 'cache', 'front', 'bump', 'heap',
+              'remote', 'inplace', 'move']
+
+
+def read_dump(path):
+    """Events of all threads as (time, thread, event) tuples, in order."""
+    with open(path, 'rb') as f:
+        data = f.read()
+    if len(data) < HEADER.size:
+        sys.exit(f'{path}: too short for an event dump')
+    magic, event_size = HEADER.unpack_from(data)
+    if magic != MM_EVENTS_MAGIC:
+        sys.exit(f'{path}: not an event dump')
+    if event_size != EVENT.size:
+        sys.exit(f'{path}: events of {event_size} bytes, '
+                 f'expected {EVENT.size}')
+    events = []
+    pos = HEADER.size
+    while pos < len(data):
+        thread, n = HEADER.unpack_from(data, pos)
+        pos += HEADER.size
+        if pos + n * EVENT.size > len(data):
+            sys.exit(f'{path}: ring of thread {thread} is cut short')
+        for ev in EVENT.iter_unpack(data[pos:pos + n * EVENT.size]):
+            events.append((ev[0], thread, ev))
+        pos += n * EVENT.size
+    events.sort(key=lambda e: e[:2])
+    return events
+
+
+def decode(events):
+    """Trace lines replaying given events, and how many ids they use."""
+    ids = {}
+    lines = []
+    next_id = 0
+
+    def alloc(ptr):
+        nonlocal next_id
+        ids[ptr] = next_id
+        next_id += 1
+        return ids[ptr]
+
+    for _, _, (_, ptr, arg, size, _, _, op, _) in events:
+        if op == MM_EV_MALLOC and ptr:
+            lines.append(f'a {alloc(ptr)} {size}')
+        elif op == MM_EV_MEMALIGN and ptr:
+            lines.append(f'm {alloc(ptr)} {arg} {size}')
+        elif op == MM_EV_FREE and ptr in ids:
+            lines.append(f'f {ids.pop(ptr)}')
+        elif op == MM_EV_REALLOC:
+            if arg and size == 0:
+                if arg in ids:
+                    lines.append(f'f {ids.pop(arg)}')
+            elif not ptr:
+                continue
+            elif arg in ids:
+                i = ids.pop(arg)
+                ids[ptr] = i
+                lines.append(f'r {i} {size}')
+            else:
+                lines.append(f'a {alloc(ptr)} {size}')
+        elif op == MM_EV_RESIZE and ptr in ids:
+            lines.append(f'r {ids[ptr]} {size}')
+    return lines, next_id
+
+
+def summary(events, out):
+    calls = {}
+    for _, _, (_, _, _, _, ticks, probes, op, path) in events:
+        c = calls.setdefault((op, path), [0, 0, 0, 0])
+        c[0] += 1
+        c[1] += ticks
+        c[2] = max(c[2], ticks)
+        c[3] += probes
+    print(f'{"op":>9} {"path":>8} {"calls":>9} {"ticks":>8} {"max":>10} '
+          f'{"probes":>7}', file=out)
+    for (op, path), (n, ticks, top, probes) in sorted(calls.items()):
+        op = OP_NAMES[op] if op < len(OP_NAMES) else str(op)
+        path = PATH_NAMES[path] if path < len(PATH_NAMES) else str(path)
+        print(f'{op:>9} {path:>8} {n:9d} {ticks / n:8.0f} {top:10d} '
+              f'{probes / n:7.2f}', file=out)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--summary', action='store_true',
+                        help='print calls and mean ticks per path to stderr')
+    parser.add_argument('dump', help='file written by mm_events_dump()')
+    args = parser.parse_args()
+
+    events = read_dump(args.dump)
+    lines, num_ids = decode(events)
+    if args.summary:
+        summary(events, sys.stderr)
+    if not lines:
+        sys.exit(f'{args.dump}: no calls to replay')
+
+    # weight, number of ids, number of operations, ignore ranges
+    print(f'1\n{num_ids}\n{len(lines)}\n0')
+    print('\n'.join(lines))
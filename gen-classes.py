@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+"""Generate mm-classes.h, the size class table shared by the allocators.
+
+Block sizes (payload + tags, rounded to ALIGNMENT) are first mapped to
+cells: one cell per ALIGNMENT step up to SMALL_MAX, then eight cells per
+power of two.  Every cell belongs to exactly one class and classes cover
+consecutive cells, so mapping a size to its class is one table load.
+
+  ./gen-classes.py --uniform > mm-classes.h
+      15 exact classes up to 240 bytes, then four classes per power of two.
+
+  ./gen-classes.py traces/*.rep > mm-classes.h
+      Place class boundaries so that each class gets a similar share of
+      the allocation requests found in the given traces.  Classes below
+      SPACED_MAX never span more than MAX_SPACING, so slab tiers rounding
+      up to the class size waste a bounded fraction of each object.
+"""
+
+import argparse
+
+ALIGNMENT = 16
+TAGS_SIZE = 8
+NCLASSES = 64
+SMALL_MAX = 1024
+SMALL_CELLS = SMALL_MAX // ALIGNMENT + 1
+MIN_LOG = SMALL_MAX.bit_length() - 1
+MAX_LOG = 31
+SPACED_MAX = 32768
+MAX_SPACING = 1.25
+NCELLS = SMALL_CELLS + (MAX_LOG - MIN_LOG + 1) * 8
+
+
+def round_up(size):
+    return (size + ALIGNMENT - 1) & -ALIGNMENT
+
+
+def cell_of(size):
+    if size <= SMALL_MAX:
+        return size // ALIGNMENT
+    e = min(size.bit_length() - 1, MAX_LOG)
+    return SMALL_CELLS + ((e - MIN_LOG) << 3) + ((size >> (e - 3)) & 7)
+
+
+def cell_range(cell):
+    """Smallest and largest block size that falls into given cell."""
+    if cell < SMALL_CELLS:
+        return cell * ALIGNMENT, cell * ALIGNMENT
+    e, sub = divmod(cell - SMALL_CELLS, 8)
+    e += MIN_LOG
+    lo = (1 << e) + sub * (1 << (e - 3))
+    hi = lo + (1 << (e - 3)) - ALIGNMENT
+    return max(lo, SMALL_MAX + ALIGNMENT), hi
+
+
+def uniform_classes():
+    cells = []
+    for cell in range(NCELLS):
+        size = cell_range(cell)[0]
+        if size < 256:
+            k = max(size // ALIGNMENT - 1, 0)
+        else:
+            e = size.bit_length() - 1
+            k = 15 + ((e - 8) << 2) + ((size >> (e - 2)) & 3)
+        cells.append(min(k, NCLASSES - 1))
+    return cells
+
+
+def read_histogram(paths):
+    hist = [0] * NCELLS
+    for path in paths:
+        with open(path) as f:
+            lines = f.read().split('\n')[4:]
+        for line in lines:
+            fs = line.split()
+            if len(fs) == 3 and fs[0] in ('a', 'r'):
+                hist[cell_of(round_up(int(fs[2]) + TAGS_SIZE))] += 1
+            elif len(fs) == 4 and fs[0] == 'A':
+                hist[cell_of(round_up(int(fs[3]) + TAGS_SIZE))] += int(fs[2])
+    return hist
+
+
+def tuned_classes(hist):
+    # Minimum block is ALIGNMENT bytes and gets a class of its own.
+    cells = [0, 0]
+    mass = sum(hist[2:])
+    last = max([c for c in range(NCELLS) if hist[c]] + [2])
+    k = 1
+    acc = 0
+    lo = cell_range(2)[0]
+    for cell in range(2, NCELLS):
+        # Sizes never seen in the traces all go to the catch-all class.
+        if cell > last:
+            k = NCLASSES - 1
+        cells.append(k)
+        acc += hist[cell]
+        left = NCLASSES - 1 - k
+        if left == 0 or cell >= last:
+            continue
+        target = mass / (left + 1)
+        # Close the class once it has its share, or if the next cell alone
+        # would overshoot more than stopping here undershoots.
+        close = acc >= target or (acc and acc + hist[cell + 1] - target >
+                                  target - acc)
+        # ... or if taking the next cell would make it too wide.
+        next_lo, next_hi = cell_range(cell + 1)
+        if lo <= SPACED_MAX and next_hi > lo * MAX_SPACING:
+            close = True
+        if close:
+            mass -= acc
+            acc = 0
+            k += 1
+            lo = next_lo
+    return cells
+
+
+def first_range_class(cells):
+    lo = [None] * NCLASSES
+    hi = [0] * NCLASSES
+    for cell in range(1, NCELLS):
+        k = cells[cell]
+        cell_lo, cell_hi = cell_range(cell)
+        lo[k] = cell_lo if lo[k] is None else lo[k]
+        hi[k] = max(hi[k], cell_hi)
+    for k in range(NCLASSES):
+        if lo[k] is not None and lo[k] != hi[k]:
+            return k
+    return NCLASSES - 1
+
+
+def class_sizes(cells):
+    sizes = [0] * NCLASSES
+    for cell, k in enumerate(cells):
+        sizes[k] = max(sizes[k], cell_range(cell)[1])
+    sizes[NCLASSES - 1] = (1 << 32) - ALIGNMENT
+    # Classes no cell maps to still get a sensible, monotone size.
+    for k in range(1, NCLASSES):
+        sizes[k] = max(sizes[k], sizes[k - 1])
+    return sizes
+
+
+def table(values, per_line):
+    rows = []
+    for i in range(0, len(values), per_line):
+        rows.append('  ' + ', '.join(str(v) for v in values[i:i + per_line]) +
+                    ',')
+    return '\n'.join(rows)
+
+
+def emit(cells, command):
+    sizes = class_sizes(cells)
+    print(f"""/* mm-classes.h - size classes shared by the allocators.
+ *
+ * Generated by: {command}
+ * Do not edit, run gen-classes.py instead.
+ */
+#ifndef MM_CLASSES_H
+#define MM_CLASSES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NCLASSES {NCLASSES}
+/* First class that holds more than one block size. */
+#define FIRST_RANGE_CLASS {first_range_class(cells)}
+
+#define CELL_SMALL_MAX {SMALL_MAX}
+#define CELL_LARGE {SMALL_CELLS}
+#define NCELLS {NCELLS}
+
+/* Class of every cell. */
+static const uint8_t cell_class[NCELLS] = {{
+{table(cells, 16)}
+}};
+
+/* Largest block size that belongs to each class. */
+static const uint32_t class_size[NCLASSES] = {{
+{table(sizes, 6)}
+}};
+
+/* Block sizes up to CELL_SMALL_MAX are indexed directly, bigger ones by
+ * their highest bit and the three bits below it. Both are computed and the
+ * right one is picked with a mask, so there is no branch to mispredict. */
+static inline unsigned size_cell(size_t size) {{
+  unsigned e = 63 - __builtin_clzl(size | CELL_SMALL_MAX);
+  e = e < {MAX_LOG} ? e : {MAX_LOG};
+  unsigned large =
+    CELL_LARGE + ((e - {MIN_LOG}) << 3) + ((size >> (e - 3)) & 7);
+  unsigned small = -(unsigned)(size <= CELL_SMALL_MAX);
+  return large ^ ((large ^ (unsigned)(size >> 4)) & small);
+}}
+
+static inline int size_class(size_t size) {{
+  return cell_class[size_cell(size)];
+}}
+
+/* Block size a segregated storage tier hands out for given block size. */
+static inline size_t class_round(size_t size) {{
+  return class_size[size_class(size)];
+}}
+
+#endif /* !MM_CLASSES_H */""")
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--uniform', action='store_true',
+                        help='fixed spacing instead of trace statistics')
+    parser.add_argument('traces', nargs='*', help='.rep files to sample')
+    args = parser.parse_args()
+
+    if args.uniform == bool(args.traces):
+        parser.error('give either --uniform or some traces')
+
+    if args.uniform:
+        cells = uniform_classes()
+    else:
+        cells = tuned_classes(read_histogram(args.traces))
+
+    if args.uniform:
+        command = './gen-classes.py --uniform'
+    else:
+        command = f'./gen-classes.py with {len(args.traces)} traces'
+    emit(cells, command)
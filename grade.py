@@ -6,8 +6,16 @@ import subprocess
 import sys
 
 
-STUDENT_DEFINED = ['mm_calloc', 'mm_checkheap', 'mm_free', 'mm_init',
-                   'mm_malloc', 'mm_realloc']
+STUDENT_DEFINED = ['mm_aligned_alloc', 'mm_arena_alloc', 'mm_arena_create',
+                   'mm_arena_destroy', 'mm_arena_reset', 'mm_block_hint',
+                   'mm_calloc', 'mm_checkheap', 'mm_class_stats', 'mm_compact',
+                   'mm_events_dump', 'mm_events_on_signal', 'mm_free',
+                   'mm_free_batch', 'mm_free_sized', 'mm_good_size',
+                   'mm_halloc', 'mm_hderef', 'mm_heap_stats', 'mm_hfree',
+                   'mm_init', 'mm_malloc', 'mm_malloc_batch',
+                   'mm_malloc_cacheline', 'mm_malloc_hint', 'mm_memalign',
+                   'mm_posix_memalign', 'mm_realloc', 'mm_resize_inplace',
+                   'mm_stats', 'mm_usable_size']
 
 
 MINUTIL = 60
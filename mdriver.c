@@ -20,11 +20,40 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#ifdef THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "memlib.h"
 #include "mm.h"
 
+/* Extensions of mm.c that the variants may lack, checked before use. */
+#pragma weak mm_arena_create
+#pragma weak mm_arena_alloc
+#pragma weak mm_arena_reset
+#pragma weak mm_arena_destroy
+#pragma weak mm_malloc_batch
+#pragma weak mm_free_batch
+#pragma weak mm_usable_size
+#pragma weak mm_good_size
+#pragma weak mm_free_sized
+#pragma weak mm_resize_inplace
+#pragma weak mm_memalign
+#pragma weak mm_posix_memalign
+#pragma weak mm_malloc_hint
+#pragma weak mm_block_hint
+#pragma weak mm_halloc
+#pragma weak mm_hderef
+#pragma weak mm_hfree
+#pragma weak mm_compact
+#pragma weak mm_stats
+#pragma weak mm_events_dump
+
 /**********************
  * Constants and macros
  **********************/
@@ -34,6 +63,9 @@
 /* cnvt trace request nums to linenums (origin 1) */
 #define LINENUM(i) (i + 5)
 
+/* Blocks up to this size should sit within one cache line */
+#define CACHE_LINE 64
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -64,9 +96,12 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-  enum { ALLOC, FREE, REALLOC } type; /* type of request */
-  int index;                          /* index for free() to use later */
-  size_t size;                        /* byte size of alloc/realloc request */
+  enum { ALLOC, FREE, REALLOC, BATCH_ALLOC, BATCH_FREE, ALIGNED_ALLOC } type;
+  int index;   /* index for free() to use later, first index of a batch */
+  int count;   /* number of blocks of a batch */
+  int align;   /* alignment of an aligned alloc */
+  int hint;    /* lifetime of an alloc known from the trace */
+  size_t size; /* byte size of alloc/realloc request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -75,11 +110,24 @@ typedef struct {
   int ignore_ranges;    /* don't check ranges (i.e. this is too big) */
   int num_ids;          /* number of alloc/realloc ids */
   int num_ops;          /* number of distinct requests */
+  int num_reqs;         /* ... where each block of a batch counts as one */
   int weight;           /* weight for this trace (unused) */
   traceop_t *ops;       /* array of requests */
   char **blocks;        /* array of ptrs returned by malloc/realloc... */
   size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
   int *block_rand_base; /* index into random_data, if debug is on */
+  int small;            /* blocks of up to CACHE_LINE bytes allocated... */
+  int straddle;         /* ... and those of them crossing a cache line */
+  int allocs;           /* alloc ops... */
+  int young;            /* ... that are freed within MM_SHORT_LIFE allocs */
+  int bumped;           /* ... that mm placed as short-lived */
+  int hits;             /* ... where mm got the lifetime right */
+  mm_stats_t at_peak;   /* mm_stats() of the util run at most live bytes... */
+  mm_stats_t at_end;    /* ... and once it is over, set only with -S */
+  int counted;          /* mm_stats() had event counters */
+  int samples;          /* timeline rows printed with -T... */
+  double util_sum;      /* ... their live bytes over heap size... */
+  double frag_sum;      /* ... and external fragmentation, summed */
 } trace_t;
 
 /*
@@ -108,6 +156,30 @@ typedef struct {
   int used;    /* maximum bytes used by allocated blocks */
   int total;   /* total heap size */
 
+  /* small blocks and how many of them cross a cache line */
+  int small;
+  int straddle;
+
+  /* lifetimes known from the trace against those mm predicted */
+  int allocs;
+  int young;
+  int bumped;
+  int hits;
+
+  /* allocator counters and free space of the util run, only with -S */
+  mm_stats_t at_peak;
+  mm_stats_t at_end;
+  int counted; /* mm counts events, else only free space is known */
+
+  /* averages over the timeline of the util run, only with -T */
+  int samples;
+  double avg_util;
+  double avg_frag;
+
+  /* hardware counters for the timed run, set only with -p */
+  int perf_valid;
+  long long perf[3];
+
   /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -132,6 +204,16 @@ static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode = DBG_CHEAP;
 
 static int verbose = 1; /* global flag for verbose output */
 
+static int perf_counters = 0; /* read hardware counters around timed run */
+
+static int lifetime_hints = 0; /* pass lifetimes from the trace to mm */
+
+static int alloc_stats = 0; /* print mm_stats() of the util run */
+
+static int timeline = 0; /* print heap state every timeline ops as CSV */
+
+static char *event_file = NULL; /* dump mm events of the util run there */
+
 /*********************
  * Function prototypes
  *********************/
@@ -149,6 +231,7 @@ static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *filename);
+static void oracle_lifetimes(trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -164,6 +247,7 @@ static void eval_mm_speed(void *ptr);
 
 /* Various helper routines */
 static void printresults(stats_t *stats);
+static void print_alloc_stats(stats_t *stats);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
   __attribute__((format(printf, 3, 4)));
@@ -192,6 +276,66 @@ static double fsecs(fsecs_test_funct f, void *argp) {
   return (1E-3 * diff);
 }
 
+/*
+ * Hardware counters sampled around the timed run (-p). Events are read as
+ * one group, so all of them cover exactly the same instructions.
+ */
+static const struct {
+  const char *name;
+  __u32 type;
+  __u64 config;
+} perf_events[3] = {
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"L1d-misses", PERF_TYPE_HW_CACHE,
+   PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {"LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+/*
+ * fperf - Like fsecs, but also fill in the counters from perf_events.
+ *    Returns 0 and leaves counts alone if the kernel refuses them.
+ */
+static int fperf(fsecs_test_funct f, void *argp, long long *counts,
+                 double *secs) {
+  int fd[3];
+  struct {
+    __u64 nr;
+    __u64 values[3];
+  } data;
+
+  for (int i = 0; i < 3; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    attr.disabled = (i == 0);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i ? fd[0] : -1, 0);
+    if (fd[i] < 0) {
+      while (--i >= 0)
+        close(fd[i]);
+      *secs = fsecs(f, argp);
+      return 0;
+    }
+  }
+
+  ioctl(fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  *secs = fsecs(f, argp);
+  ioctl(fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  int ok = read(fd[0], &data, sizeof(data)) == sizeof(data);
+  for (int i = 0; i < 3; i++) {
+    counts[i] = data.values[i];
+    close(fd[i]);
+  }
+  return ok;
+}
+
 /* Run the tests; return the number of tests run (may be less than
    num_tracefiles, if there's a timeout) */
 static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
@@ -203,7 +347,7 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
   trace_t *trace;
   trace = read_trace(mm_stats, tracefile);
   strcpy(mm_stats->filename, trace->filename);
-  mm_stats->ops = trace->num_ops;
+  mm_stats->ops = trace->num_reqs;
   if (verbose > 1)
     printf("Checking mm_malloc for correctness, ");
   mm_stats->valid = eval_mm_valid(trace, &ranges);
@@ -212,11 +356,34 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
     if (verbose > 1)
       printf("efficiency, ");
     mm_stats->util = eval_mm_util(trace, &mm_stats->used, &mm_stats->total);
+    if (event_file && mm_events_dump(event_file) < 0)
+      app_error("Could not dump mm events to %s, is mm.c built with "
+                "EVENTS?\n", event_file);
+    mm_stats->small = trace->small;
+    mm_stats->straddle = trace->straddle;
+    mm_stats->allocs = trace->allocs;
+    mm_stats->young = trace->young;
+    mm_stats->bumped = trace->bumped;
+    mm_stats->hits = trace->hits;
+    if (alloc_stats) {
+      mm_stats->at_peak = trace->at_peak;
+      mm_stats->at_end = trace->at_end;
+      mm_stats->counted = trace->counted;
+    }
+    if (trace->samples) {
+      mm_stats->samples = trace->samples;
+      mm_stats->avg_util = trace->util_sum / trace->samples;
+      mm_stats->avg_frag = trace->frag_sum / trace->samples;
+    }
     speed_params->trace = trace;
     speed_params->ranges = ranges;
     if (verbose > 1)
       printf("and performance.\n");
-    mm_stats->secs = fsecs(eval_mm_speed, speed_params);
+    if (perf_counters)
+      mm_stats->perf_valid = fperf(eval_mm_speed, speed_params,
+                                   mm_stats->perf, &mm_stats->secs);
+    else
+      mm_stats->secs = fsecs(eval_mm_speed, speed_params);
   }
 
   free_trace(trace);
@@ -225,6 +392,585 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
   mem_deinit();
 }
 
+/********************************************
+ * Movable blocks and the compactor
+ *******************************************/
+
+/*
+ * Compaction benchmark (-C). The trace is replayed with movable blocks
+ * from mm_halloc, aligned allocs become plain ones and a realloc is a new
+ * handle and a copy. Every block is filled with its id, which is checked
+ * when it is freed. The first run stops where the most bytes are live and
+ * compacts the heap there step by step, for utilization before and after.
+ * The other two run the whole trace, without compaction and with a step
+ * after every free.
+ */
+#define COMPACT_BUDGET 4096 /* bytes one step may move */
+
+typedef struct {
+  trace_t *trace;
+  mm_handle_t *handles; /* handle of every id */
+  long live;            /* bytes of live blocks */
+  long peak;            /* ... at most */
+  int steps;            /* compaction steps taken */
+  long moved;           /* bytes they moved */
+  double pause;         /* their time in seconds */
+  double max_pause;     /* ... and the longest one */
+} compact_bench_t;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static size_t compact_step(compact_bench_t *bench) {
+  double start = now();
+  size_t moved = mm_compact(COMPACT_BUDGET);
+  double pause = now() - start;
+
+  bench->steps++;
+  bench->moved += moved;
+  bench->pause += pause;
+  if (pause > bench->max_pause)
+    bench->max_pause = pause;
+  return moved;
+}
+
+static void compact_free(compact_bench_t *bench, int index) {
+  mm_handle_t h = index < 0 ? NULL : bench->handles[index];
+  if (h == NULL)
+    return;
+  unsigned char *p = mm_hderef(h);
+  size_t size = bench->trace->block_sizes[index];
+  for (size_t i = 0; i < size; i++)
+    if (p[i] != (unsigned char)index)
+      app_error("block %d changed at byte %zu", index, i);
+  mm_hfree(h);
+  bench->handles[index] = NULL;
+  bench->live -= size;
+}
+
+static void compact_alloc(compact_bench_t *bench, int index, size_t size) {
+  mm_handle_t h = mm_halloc(size);
+  if (h == NULL)
+    app_error("mm_halloc failed in compact_bench");
+
+  /* A realloc keeps what fits, the rest is filled anew. */
+  size_t keep = 0;
+  if (bench->handles[index]) {
+    keep = bench->trace->block_sizes[index];
+    keep = keep < size ? keep : size;
+    memcpy(mm_hderef(h), mm_hderef(bench->handles[index]), keep);
+    compact_free(bench, index);
+  }
+  memset(mm_hderef(h) + keep, index, size - keep);
+  bench->handles[index] = h;
+  bench->trace->block_sizes[index] = size;
+  bench->live += size;
+  if (bench->live > bench->peak)
+    bench->peak = bench->live;
+}
+
+/*
+ * compact_run - Replay the first nops ops of the trace, with a compaction
+ *     step after every free if step is set.
+ */
+static void compact_run(compact_bench_t *bench, int nops, int step) {
+  traceop_t *op = bench->trace->ops;
+
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in compact_run");
+  memset(bench->handles, 0, bench->trace->num_ids * sizeof(mm_handle_t));
+  bench->live = bench->peak = bench->moved = bench->steps = 0;
+  bench->pause = bench->max_pause = 0;
+
+  for (int i = 0; i < nops; i++, op++) {
+    switch (op->type) {
+      case ALLOC:
+      case ALIGNED_ALLOC:
+      case REALLOC:
+        compact_alloc(bench, op->index, op->size);
+        break;
+
+      case FREE:
+        compact_free(bench, op->index);
+        break;
+
+      case BATCH_ALLOC:
+        for (int j = 0; j < op->count; j++)
+          compact_alloc(bench, op->index + j, op->size);
+        break;
+
+      case BATCH_FREE:
+        for (int j = 0; j < op->count; j++)
+          compact_free(bench, op->index + j);
+        break;
+    }
+    if (step && (op->type == FREE || op->type == BATCH_FREE))
+      compact_step(bench);
+  }
+}
+
+/*
+ * peak_ops - Number of ops of the trace up to the most live bytes
+ */
+static int peak_ops(trace_t *trace) {
+  size_t *sizes = trace->block_sizes;
+  long live = 0, peak = 0;
+  int nops = 0;
+
+  reinit_trace(trace);
+  for (int i = 0; i < trace->num_ops; i++) {
+    traceop_t *op = &trace->ops[i];
+    switch (op->type) {
+      case ALLOC:
+      case ALIGNED_ALLOC:
+      case REALLOC:
+        live += (long)op->size - (long)sizes[op->index];
+        sizes[op->index] = op->size;
+        break;
+      case FREE:
+        if (op->index >= 0) {
+          live -= sizes[op->index];
+          sizes[op->index] = 0;
+        }
+        break;
+      case BATCH_ALLOC:
+        for (int j = op->index; j < op->index + op->count; j++)
+          live += sizes[j] = op->size;
+        break;
+      case BATCH_FREE:
+        for (int j = op->index; j < op->index + op->count; j++) {
+          live -= sizes[j];
+          sizes[j] = 0;
+        }
+        break;
+    }
+    if (live > peak) {
+      peak = live;
+      nops = i + 1;
+    }
+  }
+
+  reinit_trace(trace);
+  return nops;
+}
+
+static void compact_print(const char *name, compact_bench_t *bench,
+                          long used, size_t heap) {
+  printf("%-18s %6.1f%% %9lu", name, 100.0 * used / heap, heap >> 10);
+  if (bench->steps)
+    printf(" %7d %9ld %9.2f %9.2f", bench->steps, bench->moved >> 10,
+           1e6 * bench->pause / bench->steps, 1e6 * bench->max_pause);
+  printf("\n");
+}
+
+/*
+ * compact_bench - Utilization and pauses of compaction on one trace.
+ */
+static void compact_bench(const char *tracefile) {
+  stats_t stats;
+  compact_bench_t bench = {0};
+
+  /* The variants are linked without handles. */
+  if (!mm_halloc)
+    app_error("-C needs an allocator with handles\n");
+
+  bench.trace = read_trace(&stats, tracefile);
+  bench.handles = calloc(bench.trace->num_ids, sizeof(mm_handle_t));
+
+  printf("Compaction benchmark, steps of up to %d bytes\n", COMPACT_BUDGET);
+  printf("%-18s %7s %9s %7s %9s %9s %9s\n", "", "util", "heap KB", "steps",
+         "moved KB", "avg us", "max us");
+  mem_init();
+
+  /* Where the most bytes are live, compacted till nothing moves. */
+  compact_run(&bench, peak_ops(bench.trace), 0);
+  compact_print("peak live", &bench, bench.live, mem_heapsize());
+  while (compact_step(&bench))
+    ;
+  compact_print("... compacted", &bench, bench.live, mem_heapsize());
+
+  compact_run(&bench, bench.trace->num_ops, 0);
+  compact_print("no compaction", &bench, bench.peak, mem_heap_peak());
+  compact_run(&bench, bench.trace->num_ops, 1);
+  compact_print("step after frees", &bench, bench.peak, mem_heap_peak());
+
+  mem_deinit();
+  free(bench.handles);
+  free_trace(bench.trace);
+}
+
+/********************************************
+ * Request-scoped allocations and mm arenas
+ *******************************************/
+
+/*
+ * Arena benchmark (-A). The ops are grouped into lifetimes, like the work
+ * of one request: a lifetime mallocs a few hundred small objects, uses
+ * them, and all of them die together at its end. The same ops are run
+ * once with mm_malloc and mm_free, and once with an mm arena that is reset
+ * at the end of each lifetime.
+ */
+#define ARENA_LIFETIMES 4096 /* lifetimes in one run */
+#define ARENA_MAX_OPS 512    /* most objects allocated by one lifetime */
+
+typedef struct {
+  int *nops;      /* objects allocated by each lifetime */
+  size_t *sizes;  /* their sizes, all lifetimes one after another */
+  void **blocks;  /* live objects of the current lifetime */
+  int use_arena;
+} arena_bench_t;
+
+static void arena_run(void *ptr) {
+  arena_bench_t *bench = ptr;
+  size_t *size = bench->sizes;
+  mm_arena_t *arena = NULL;
+
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in arena_run");
+  if (bench->use_arena && !(arena = mm_arena_create(0)))
+    app_error("mm_arena_create failed");
+
+  for (int l = 0; l < ARENA_LIFETIMES; l++) {
+    int n = bench->nops[l];
+    for (int i = 0; i < n; i++, size++) {
+      char *p = arena ? mm_arena_alloc(arena, *size) : mm_malloc(*size);
+      if (p == NULL)
+        app_error("allocation failed in lifetime %d", l);
+      p[0] = i;
+      bench->blocks[i] = p;
+    }
+    if (arena) {
+      mm_arena_reset(arena);
+    } else {
+      for (int i = 0; i < n; i++)
+        mm_free(bench->blocks[i]);
+    }
+  }
+
+  mm_arena_destroy(arena);
+}
+
+/*
+ * arena_check - Sizes that wrap around once rounded up must fail
+ */
+static void arena_check(void) {
+  /* Wraps when rounded up, or when the chunk header is added. */
+  static const size_t huge[] = {SIZE_MAX, SIZE_MAX - ALIGNMENT + 1,
+                                SIZE_MAX - ALIGNMENT - 8};
+
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in arena_check");
+  mm_arena_t *arena = mm_arena_create(0);
+  if (!arena)
+    app_error("mm_arena_create failed");
+  for (int i = 0; i < sizeof(huge) / sizeof(huge[0]); i++) {
+    if (mm_arena_create(huge[i]))
+      app_error("mm_arena_create of %zu bytes did not fail", huge[i]);
+    if (mm_arena_alloc(arena, huge[i]))
+      app_error("mm_arena_alloc of %zu bytes did not fail", huge[i]);
+  }
+  mm_arena_destroy(arena);
+}
+
+/*
+ * arena_bench - Time the lifetimes with malloc and free against an arena.
+ */
+static void arena_bench(void) {
+  arena_bench_t bench;
+  unsigned seed = 1;
+  long nops = 0;
+
+  /* The variants are linked without the arena functions. */
+  if (!mm_arena_create)
+    app_error("-A needs an allocator with mm arenas\n");
+
+  bench.nops = calloc(ARENA_LIFETIMES, sizeof(int));
+  for (int l = 0; l < ARENA_LIFETIMES; l++)
+    nops += bench.nops[l] = ARENA_MAX_OPS / 4 +
+                            rand_r(&seed) % (ARENA_MAX_OPS * 3 / 4);
+  bench.sizes = calloc(nops, sizeof(size_t));
+  for (long i = 0; i < nops; i++)
+    bench.sizes[i] = 8 + rand_r(&seed) % 120 + 32 * (rand_r(&seed) % 8 == 0);
+  bench.blocks = calloc(ARENA_MAX_OPS, sizeof(void *));
+
+  printf("Arena benchmark, %d lifetimes of %d..%d objects\n",
+         ARENA_LIFETIMES, ARENA_MAX_OPS / 4, ARENA_MAX_OPS - 1);
+  printf("%12s %10s %10s %10s\n", "", "secs", "Kops", "heap KB");
+  mem_init();
+  arena_check();
+  for (bench.use_arena = 0; bench.use_arena < 2; bench.use_arena++) {
+    double secs = fsecs(arena_run, &bench);
+    printf("%12s %10.6f %10.0f %10lu\n",
+           bench.use_arena ? "arena" : "malloc/free", secs,
+           2.0 * nops / 1e3 / secs, mem_heapsize() >> 10);
+  }
+  mem_deinit();
+
+  free(bench.nops);
+  free(bench.sizes);
+  free(bench.blocks);
+}
+
+/***********************************************************
+ * Multi-threaded benchmarks, built only with make THREADS=1
+ **********************************************************/
+
+#ifdef THREADS
+/*
+ * Cross-thread free benchmark (-P). Producers malloc blocks and hand them
+ * over to consumers, which free them, so every free is of a block some
+ * other thread allocated. Each producer/consumer pair has its own ring.
+ */
+#define XFREE_BLOCKS (1 << 20) /* blocks handed over in one run */
+#define XFREE_RING 256         /* slots in each ring */
+
+typedef struct {
+  void *slot[XFREE_RING];
+  unsigned head; /* advanced by the consumer */
+  unsigned tail; /* advanced by the producer */
+} xring_t;
+
+typedef struct {
+  int nprod, ncons;
+  xring_t *rings; /* ring of producer p and consumer c is p * ncons + c */
+  int done;       /* producers that finished */
+} xfree_t;
+
+typedef struct {
+  xfree_t *bench;
+  int id;
+  pthread_t thread;
+} xthread_t;
+
+static void *xfree_producer(void *arg) {
+  xthread_t *self = arg;
+  xfree_t *bench = self->bench;
+  unsigned seed = self->id;
+  long n = XFREE_BLOCKS / bench->nprod;
+
+  for (long i = 0; i < n; i++) {
+    size_t size = 16 << (rand_r(&seed) % 6);
+    char *p = mm_malloc(size);
+    if (p == NULL)
+      app_error("mm_malloc failed in producer %d\n", self->id);
+    p[0] = self->id;
+
+    xring_t *ring = &bench->rings[self->id * bench->ncons + i % bench->ncons];
+    while (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+           XFREE_RING)
+      sched_yield();
+    ring->slot[ring->tail % XFREE_RING] = p;
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+  }
+
+  __atomic_fetch_add(&bench->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void *xfree_consumer(void *arg) {
+  xthread_t *self = arg;
+  xfree_t *bench = self->bench;
+
+  for (;;) {
+    /* Read before the scan: if all producers were done by then, a scan
+     * that finds nothing means everything has been freed. */
+    int finished =
+      __atomic_load_n(&bench->done, __ATOMIC_ACQUIRE) == bench->nprod;
+    int idle = 1;
+
+    for (int p = 0; p < bench->nprod; p++) {
+      xring_t *ring = &bench->rings[p * bench->ncons + self->id];
+      unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+      while (ring->head != tail) {
+        mm_free(ring->slot[ring->head % XFREE_RING]);
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+        idle = 0;
+      }
+    }
+
+    if (finished && idle)
+      return NULL;
+    if (idle)
+      sched_yield();
+  }
+}
+
+static void xfree_run(void *ptr) {
+  xfree_t *bench = ptr;
+  xthread_t *threads = calloc(bench->nprod + bench->ncons, sizeof(xthread_t));
+
+  for (int i = 0; i < bench->nprod + bench->ncons; i++) {
+    xthread_t *t = &threads[i];
+    t->bench = bench;
+    t->id = i < bench->nprod ? i : i - bench->nprod;
+    if (pthread_create(&t->thread, NULL,
+                       i < bench->nprod ? xfree_producer : xfree_consumer, t))
+      unix_error("pthread_create failed");
+  }
+  for (int i = 0; i < bench->nprod + bench->ncons; i++)
+    pthread_join(threads[i].thread, NULL);
+
+  free(threads);
+}
+
+/*
+ * print_heap_stats - Per heap op counts and lock waits of the last run
+ */
+static void print_heap_stats(void) {
+  mm_heap_stats_t hs;
+
+  for (int i = 0; mm_heap_stats(i, &hs) == 0; i++) {
+    if (!hs.locks && !hs.remote_frees)
+      continue;
+    printf("%11s %d: %2u threads %8lu mallocs %8lu frees %8lu remote "
+           "%8lu locks %6lu contended %8.3f ms waited\n",
+           "heap", i, hs.threads, hs.mallocs, hs.frees, hs.remote_frees,
+           hs.locks, hs.contended, hs.wait_ns / 1e6);
+
+    mm_lock_stats_t ls;
+    for (int k = 0; mm_class_stats(i, k, &ls) == 0; k++) {
+      if (!ls.locks)
+        continue;
+      printf("%14s %2d: %8lu locks %6lu contended %12lu ticks waited "
+             "%12lu held\n",
+             "class", k, ls.locks, ls.contended, ls.wait_ticks, ls.hold_ticks);
+    }
+  }
+}
+
+/*
+ * xfree_bench - Run the cross-thread free benchmark for 1, 2, 4, ...
+ *     producers and consumers, up to maxthreads of each.
+ */
+static void xfree_bench(int maxthreads) {
+  printf("Cross-thread free benchmark, %d blocks of 16..512 bytes\n",
+         XFREE_BLOCKS);
+  printf("%5s %5s %10s %10s\n", "prod", "cons", "secs", "Kops");
+
+  for (int nprod = 1; nprod <= maxthreads; nprod *= 2) {
+    for (int ncons = 1; ncons <= maxthreads; ncons *= 2) {
+      xfree_t bench = {.nprod = nprod, .ncons = ncons};
+      bench.rings = calloc(nprod * ncons, sizeof(xring_t));
+
+      mem_init();
+      if (mm_init() < 0)
+        app_error("mm_init failed.\n");
+      double secs = fsecs(xfree_run, &bench);
+      double ops = 2.0 * (XFREE_BLOCKS / nprod) * nprod;
+      printf("%5d %5d %10.6f %10.0f\n", nprod, ncons, secs,
+             ops / 1e3 / secs);
+      print_heap_stats();
+      mem_deinit();
+
+      free(bench.rings);
+    }
+  }
+}
+
+/*
+ * Footprint benchmark (-B). Threads take turns in a ring: in round r thread
+ * r % n mallocs BLOWUP_LIVE bytes of blocks and thread (r + 1) % n frees
+ * them all. At most BLOWUP_LIVE bytes are ever live, so the peak heap size
+ * over BLOWUP_LIVE shows how much freed memory stays stranded in the heaps
+ * of threads that are not allocating.
+ */
+#define BLOWUP_LIVE (4 << 20) /* bytes live after each malloc turn */
+#define BLOWUP_ROUNDS 4       /* malloc turns of each thread */
+
+typedef struct {
+  int nthreads;
+  void **blocks;
+  long nblocks;
+  unsigned turn;  /* 2r: malloc turn of round r, 2r + 1: its free turn */
+  size_t peak;    /* largest heap size seen after a malloc turn */
+} blowup_t;
+
+typedef struct {
+  blowup_t *bench;
+  int id;
+  pthread_t thread;
+} bthread_t;
+
+static void *blowup_thread(void *arg) {
+  bthread_t *self = arg;
+  blowup_t *bench = self->bench;
+  unsigned nturns = 2 * BLOWUP_ROUNDS * bench->nthreads;
+  unsigned seed = self->id;
+
+  for (unsigned turn = 0; turn < nturns; turn++) {
+    unsigned r = turn / 2;
+    int mine = (turn & 1 ? r + 1 : r) % bench->nthreads == self->id;
+    if (!mine)
+      continue;
+    while (__atomic_load_n(&bench->turn, __ATOMIC_ACQUIRE) != turn)
+      sched_yield();
+
+    if (turn & 1) {
+      for (long i = 0; i < bench->nblocks; i++)
+        mm_free(bench->blocks[i]);
+    } else {
+      size_t live = 0;
+      bench->nblocks = 0;
+      while (live < BLOWUP_LIVE) {
+        size_t size = 16 + 16 * (rand_r(&seed) % 32);
+        char *p = mm_malloc(size);
+        if (p == NULL)
+          app_error("mm_malloc failed in thread %d\n", self->id);
+        p[0] = self->id;
+        bench->blocks[bench->nblocks++] = p;
+        live += size;
+      }
+      if (mem_heapsize() > bench->peak)
+        bench->peak = mem_heapsize();
+    }
+    __atomic_store_n(&bench->turn, turn + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/*
+ * blowup_bench - Run the footprint benchmark for 1, 2, 4, ... threads
+ *     up to maxthreads and print the peak heap size over the live bytes.
+ */
+static void blowup_bench(int maxthreads) {
+  printf("Footprint benchmark, %d rounds of %d KB live per thread\n",
+         BLOWUP_ROUNDS, BLOWUP_LIVE >> 10);
+  printf("%7s %10s %8s\n", "threads", "peak KB", "blowup");
+
+  for (int n = 1; n <= maxthreads; n *= 2) {
+    blowup_t bench = {.nthreads = n};
+    bench.blocks = calloc(BLOWUP_LIVE / 16, sizeof(void *));
+    bthread_t *threads = calloc(n, sizeof(bthread_t));
+
+    mem_init();
+    if (mm_init() < 0)
+      app_error("mm_init failed.\n");
+    for (int i = 0; i < n; i++) {
+      threads[i].bench = &bench;
+      threads[i].id = i;
+      if (pthread_create(&threads[i].thread, NULL, blowup_thread,
+                         &threads[i]))
+        unix_error("pthread_create failed");
+    }
+    for (int i = 0; i < n; i++)
+      pthread_join(threads[i].thread, NULL);
+    printf("%7d %10lu %8.2f\n", n, bench.peak >> 10,
+           (double)bench.peak / BLOWUP_LIVE);
+    print_heap_stats();
+    mem_deinit();
+
+    free(threads);
+    free(bench.blocks);
+  }
+}
+#endif
+
 /**************
  * Main routine
  **************/
@@ -235,15 +981,21 @@ int main(int argc, char **argv) {
   stats_t mm_stats;       /* mm (i.e. student) stats for trace */
   speed_t speed_params;   /* input parameters to the xx_speed routines */
   int run_libc = 0;       /* If set, run libc malloc (set by -l) */
+  int xfree_threads = 0;  /* If set, run cross-thread free benchmark (-P) */
+  int blowup_threads = 0; /* If set, run footprint benchmark (-B) */
+  int run_arena = 0;      /* If set, run arena benchmark (-A) */
+  int run_compact = 0;    /* If set, run compaction benchmark (-C) */
 
   setbuf(stdout, 0);
   setbuf(stderr, 0);
+  memset(&libc_stats, 0, sizeof(libc_stats));
+  memset(&mm_stats, 0, sizeof(mm_stats));
 
   /*
    * Read and interpret the command line arguments
    */
   char c;
-  while ((c = getopt(argc, argv, "d:f:v:hVlD")) != EOF) {
+  while ((c = getopt(argc, argv, "d:f:v:hVlDpP:B:ALCST:E:")) != EOF) {
     switch (c) {
       case 'f': /* Use one specific trace file only (relative to curr dir) */
         tracefile = strdup(optarg);
@@ -269,6 +1021,48 @@ int main(int argc, char **argv) {
         debug_mode = DBG_EXPENSIVE;
         break;
 
+      case 'p': /* Read hardware counters during timed run */
+        perf_counters = 1;
+        break;
+
+      case 'P': /* Cross-thread free benchmark */
+        xfree_threads = atoi(optarg);
+        break;
+
+      case 'B': /* Footprint benchmark */
+        blowup_threads = atoi(optarg);
+        break;
+
+      case 'A': /* Arena benchmark */
+        run_arena = 1;
+        break;
+
+      case 'C': /* Compaction benchmark */
+        run_compact = 1;
+        break;
+
+      case 'S': /* Allocator statistics, checked for in eval_mm_util */
+        alloc_stats = 1;
+        break;
+
+      case 'E': /* Dump allocator events */
+        if (!mm_events_dump)
+          app_error("-E needs mm_events_dump\n");
+        event_file = strdup(optarg);
+        break;
+
+      case 'T': /* Fragmentation timeline */
+        timeline = atoi(optarg);
+        if (timeline <= 0)
+          app_error("-T needs a positive number of ops\n");
+        break;
+
+      case 'L': /* Oracle lifetime hints */
+        if (!mm_malloc_hint)
+          app_error("-L needs mm_malloc_hint");
+        lifetime_hints = 1;
+        break;
+
       case 'h': /* Print this message */
         usage();
         exit(EXIT_SUCCESS);
@@ -279,11 +1073,33 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (run_arena) {
+    arena_bench();
+    exit(EXIT_SUCCESS);
+  }
+
+  if (xfree_threads > 0 || blowup_threads > 0) {
+#ifdef THREADS
+    if (xfree_threads > 0)
+      xfree_bench(xfree_threads);
+    if (blowup_threads > 0)
+      blowup_bench(blowup_threads);
+    exit(EXIT_SUCCESS);
+#else
+    app_error("-P and -B need the thread-safe build, run make THREADS=1\n");
+#endif
+  }
+
   if (tracefile == NULL) {
     usage();
     exit(EXIT_FAILURE);
   }
 
+  if (run_compact) {
+    compact_bench(tracefile);
+    exit(EXIT_SUCCESS);
+  }
+
   if (debug_mode != DBG_NONE)
     init_random_data();
 
@@ -298,9 +1114,15 @@ int main(int argc, char **argv) {
     trace_t *trace = read_trace(&libc_stats, tracefile);
 
     libc_stats.valid = eval_libc_valid(trace);
+    libc_stats.small = trace->small;
+    libc_stats.straddle = trace->straddle;
     if (libc_stats.valid) {
       speed_params.trace = trace;
-      libc_stats.secs = fsecs(eval_libc_speed, &speed_params);
+      if (perf_counters)
+        libc_stats.perf_valid = fperf(eval_libc_speed, &speed_params,
+                                      libc_stats.perf, &libc_stats.secs);
+      else
+        libc_stats.secs = fsecs(eval_libc_speed, &speed_params);
     }
     free_trace(trace);
 
@@ -537,6 +1359,9 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   int max_index = 0;
   char type[MAXLINE];
   int size;
+  int count;
+
+  trace->num_reqs = 0;
 
   while (fscanf(tracefile, "%s", type) != EOF) {
     switch (type[0]) {
@@ -562,11 +1387,47 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
         trace->ops[op_index].index = index;
         break;
 
+      case 'A': /* n blocks of one size, ids index .. index + n - 1 */
+        ignore += fscanf(tracefile, "%u %u %u", &index, &count, &size);
+        if (count < 1)
+          app_error("%s: empty batch", trace->filename);
+        trace->ops[op_index].type = BATCH_ALLOC;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].count = count;
+        trace->ops[op_index].size = size;
+        max_index = (index + count - 1 > max_index) ? index + count - 1
+                                                    : max_index;
+        trace->num_reqs += count - 1;
+        break;
+
+      case 'm': /* memalign of given alignment, a power of two */
+        ignore += fscanf(tracefile, "%u %u %u", &index, &count, &size);
+        if (count <= 0 || (count & (count - 1)))
+          app_error("%s: alignment %d is not a power of two", trace->filename,
+                    count);
+        trace->ops[op_index].type = ALIGNED_ALLOC;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].align = count;
+        trace->ops[op_index].size = size;
+        max_index = (index > max_index) ? index : max_index;
+        break;
+
+      case 'F': /* blocks of ids index .. index + n - 1 */
+        ignore += fscanf(tracefile, "%u %u", &index, &count);
+        if (count < 1)
+          app_error("%s: empty batch", trace->filename);
+        trace->ops[op_index].type = BATCH_FREE;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].count = count;
+        trace->num_reqs += count - 1;
+        break;
+
       default:
         app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                   trace->filename);
     }
     op_index++;
+    trace->num_reqs++;
     if (op_index == trace->num_ops)
       break;
   }
@@ -575,18 +1436,75 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   assert(max_index == trace->num_ids - 1);
   assert(trace->num_ops == op_index);
 
+  oracle_lifetimes(trace);
+
   /* fill in the stats */
   strcpy(stats->filename, trace->filename);
   stats->weight = trace->weight;
-  stats->ops = trace->num_ops;
+  stats->ops = trace->num_reqs;
 
   return trace;
 }
 
+/*
+ * oracle_lifetimes - Mark the allocs of blocks freed within MM_SHORT_LIFE
+ *     allocs as short-lived. Time is counted in blocks allocated, a
+ *     realloc ends the life of its block. Blocks that are never freed
+ *     live long.
+ */
+static void oracle_lifetimes(trace_t *trace) {
+  int *born, *birth;
+  if (!(born = malloc(trace->num_ids * sizeof(int))) ||
+      !(birth = malloc(trace->num_ids * sizeof(int))))
+    unix_error("malloc failed in oracle_lifetimes");
+
+  /* born is the op of the alloc that made a block, -1 if not an alloc */
+  for (int i = 0; i < trace->num_ids; i++)
+    born[i] = -1;
+
+  int clock = 0;
+  for (int i = 0; i < trace->num_ops; i++) {
+    traceop_t *op = &trace->ops[i];
+    int index = op->index;
+    op->hint = MM_HINT_LONG;
+    switch (op->type) {
+      case ALLOC:
+        born[index] = i;
+        birth[index] = clock++;
+        break;
+      case REALLOC:
+      case FREE:
+        if (index >= 0 && born[index] >= 0 &&
+            clock - birth[index] < MM_SHORT_LIFE)
+          trace->ops[born[index]].hint = MM_HINT_SHORT;
+        if (index >= 0)
+          born[index] = -1;
+        clock += op->type == REALLOC;
+        break;
+      case ALIGNED_ALLOC:
+        born[index] = -1;
+        clock++;
+        break;
+      case BATCH_ALLOC:
+        for (int j = index; j < index + op->count; j++)
+          born[j] = -1;
+        clock += op->count;
+        break;
+      case BATCH_FREE:
+        break;
+    }
+  }
+
+  free(born);
+  free(birth);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
 static void reinit_trace(trace_t *trace) {
+  trace->small = trace->straddle = 0;
+  trace->allocs = trace->young = trace->bumped = trace->hits = 0;
   memset(trace->blocks, 0, trace->num_ids * sizeof(*trace->blocks));
   memset(trace->block_sizes, 0, trace->num_ids * sizeof(*trace->block_sizes));
   /* block_rand_base is unused if size is zero */
@@ -609,6 +1527,155 @@ static void free_trace(trace_t *trace) {
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * batch_malloc, batch_free - Batch ops of the traces, done one block at a
+ *     time for a package without mm_malloc_batch and mm_free_batch.
+ */
+static size_t batch_malloc(size_t size, size_t n, char **out) {
+  if (mm_malloc_batch)
+    return mm_malloc_batch(size, n, (void **)out);
+  for (size_t i = 0; i < n; i++)
+    if ((out[i] = mm_malloc(size)) == NULL)
+      return i;
+  return n;
+}
+
+static void batch_free(char **ptrs, size_t n) {
+  if (mm_free_batch) {
+    mm_free_batch((void **)ptrs, n);
+    return;
+  }
+  for (size_t i = 0; i < n; i++)
+    mm_free(ptrs[i]);
+}
+
+/*
+ * count_straddle - Count a small block and whether it crosses a cache line
+ */
+static void count_straddle(trace_t *trace, char *p, size_t size) {
+  if (size == 0 || size > CACHE_LINE)
+    return;
+  trace->small++;
+  if ((unsigned long)p % CACHE_LINE + size > CACHE_LINE)
+    trace->straddle++;
+}
+
+/*
+ * aligned_malloc - Aligned alloc ops of the traces
+ */
+static char *aligned_malloc(size_t alignment, size_t size) {
+  if (!mm_memalign)
+    app_error("aligned alloc ops need mm_memalign");
+  return mm_memalign(alignment, size);
+}
+
+/*
+ * check_memalign - Alignments posix_memalign must refuse, and sizes no
+ *     aligned alloc can satisfy
+ */
+static int check_memalign(trace_t *trace, int opnum, size_t align,
+                          size_t size) {
+  static const size_t bad[] = {0, sizeof(void *) / 2, 3 * sizeof(void *)};
+  static const size_t huge[] = {SIZE_MAX, SIZE_MAX - 8};
+  void *p = NULL;
+
+  for (int j = 0; j < sizeof(huge) / sizeof(huge[0]); j++) {
+    if ((p = aligned_malloc(align, huge[j])) != NULL) {
+      malloc_error(trace, opnum, "mm_memalign of %zu bytes returned %p.",
+                   huge[j], p);
+      return 0;
+    }
+  }
+  if (!mm_posix_memalign)
+    return 1;
+  for (int j = 0; j < sizeof(bad) / sizeof(bad[0]); j++) {
+    if (mm_posix_memalign(&p, bad[j], size) != EINVAL) {
+      malloc_error(trace, opnum, "mm_posix_memalign with alignment %zu did "
+                   "not fail with EINVAL.", bad[j]);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * trace_malloc - Alloc ops of the traces, with their lifetime if -L
+ */
+static char *trace_malloc(const traceop_t *op) {
+  if (lifetime_hints)
+    return mm_malloc_hint(op->size, op->hint);
+  return mm_malloc(op->size);
+}
+
+/*
+ * count_lifetime - Compare the lifetime mm predicted for an alloc with the
+ *     one known from the trace
+ */
+static void count_lifetime(trace_t *trace, const traceop_t *op, char *p) {
+  if (!mm_block_hint)
+    return;
+  int hint = mm_block_hint(p);
+  trace->allocs++;
+  trace->young += op->hint == MM_HINT_SHORT;
+  trace->bumped += hint == MM_HINT_SHORT;
+  trace->hits += hint == op->hint;
+}
+
+/*
+ * check_huge - Sizes that wrap around when rounded must fail, and a failed
+ *     realloc must leave its block alone
+ */
+static int check_huge(trace_t *trace) {
+  static const size_t sizes[] = {SIZE_MAX, SIZE_MAX - 8};
+  char *p = mm_malloc(16);
+  if (!p) {
+    malloc_error(trace, 0, "mm_malloc failed.");
+    return 0;
+  }
+  memset(p, 0x5a, 16);
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    if (mm_malloc(sizes[i]) || mm_realloc(p, sizes[i])) {
+      malloc_error(trace, 0, "mm_malloc or mm_realloc of %zu bytes did not "
+                   "fail.", sizes[i]);
+      return 0;
+    }
+  }
+  for (int i = 0; i < 16; i++) {
+    if (p[i] != 0x5a) {
+      malloc_error(trace, 0, "Failed mm_realloc changed the block.");
+      return 0;
+    }
+  }
+  mm_free(p);
+  return 1;
+}
+
+/*
+ * check_resize - A desired size no block can have must leave the block at
+ *     least min bytes, however it wraps around when rounded
+ */
+static int check_resize(trace_t *trace) {
+  if (!mm_resize_inplace)
+    return 1;
+  /* The second block keeps the first from growing at the end of the heap,
+   * so nothing asks memlib for more than it has. */
+  char *p = mm_malloc(200);
+  char *q = mm_malloc(16);
+  if (!p || !q) {
+    malloc_error(trace, 0, "mm_malloc failed.");
+    return 0;
+  }
+  size_t size = mm_resize_inplace(p, 100, SIZE_MAX - 4);
+  if (size < 100 || size != mm_usable_size(p)) {
+    malloc_error(trace, 0, "mm_resize_inplace to at least 100 bytes left "
+                 "%zu.", size);
+    return 0;
+  }
+  mm_free(q);
+  mm_free(p);
+  return 1;
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -623,6 +1690,8 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
     malloc_error(trace, 0, "mm_init failed.");
     return 0;
   }
+  if (!check_resize(trace) || !check_huge(trace))
+    return 0;
 
   /* Interpret each operation in the trace in order */
   for (int i = 0; i < trace->num_ops; i++) {
@@ -647,7 +1716,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
     switch (trace->ops[i].type) {
       case ALLOC: /* mm_malloc */
         /* Call the student's malloc */
-        if ((p = mm_malloc(size)) == NULL) {
+        if ((p = trace_malloc(&trace->ops[i])) == NULL) {
           malloc_error(trace, i, "mm_malloc failed.");
           return 0;
         }
@@ -660,6 +1729,14 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
         if (add_range(ranges, p, size, trace, i, index) == 0)
           return 0;
 
+        /* The package must not promise more than the block holds. */
+        if (mm_usable_size && (mm_usable_size(p) < size ||
+                               mm_good_size(size) > mm_usable_size(p))) {
+          malloc_error(trace, i, "mm_usable_size %zu below mm_good_size %zu.",
+                       mm_usable_size(p), mm_good_size(size));
+          return 0;
+        }
+
         /* Remember region */
         trace->blocks[index] = p;
         trace->block_sizes[index] = size;
@@ -712,7 +1789,56 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
           p = trace->blocks[index];
           remove_range(ranges, p);
         }
-        mm_free(p);
+        /* Every other free is sized, so both entry points are covered. */
+        if (mm_free_sized && index != -1 && i % 2)
+          mm_free_sized(p, trace->block_sizes[index]);
+        else
+          mm_free(p);
+        break;
+
+      case ALIGNED_ALLOC: /* mm_memalign */
+        if (!check_memalign(trace, i, trace->ops[i].align, size))
+          return 0;
+        if ((p = aligned_malloc(trace->ops[i].align, size)) == NULL) {
+          malloc_error(trace, i, "mm_memalign failed.");
+          return 0;
+        }
+        if ((unsigned long)p % trace->ops[i].align) {
+          malloc_error(trace, i, "Payload address (%p) not aligned to %d "
+                       "bytes", p, trace->ops[i].align);
+          return 0;
+        }
+        if (add_range(ranges, p, size, trace, i, index) == 0)
+          return 0;
+
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        randomize_block(trace, index);
+        break;
+
+      case BATCH_ALLOC: /* mm_malloc_batch */
+        if (batch_malloc(size, trace->ops[i].count, &trace->blocks[index]) <
+            trace->ops[i].count) {
+          malloc_error(trace, i, "mm_malloc_batch failed.");
+          return 0;
+        }
+
+        /* Check and remember every block, like for mm_malloc. */
+        for (int j = index; j < index + trace->ops[i].count; j++) {
+          if (add_range(ranges, trace->blocks[j], size, trace, i, j) == 0)
+            return 0;
+          trace->block_sizes[j] = size;
+          randomize_block(trace, j);
+        }
+        break;
+
+      case BATCH_FREE: /* mm_free_batch */
+        for (int j = index; j < index + trace->ops[i].count; j++) {
+          check_index(trace, i, j);
+          remove_range(ranges, trace->blocks[j]);
+        }
+        /* Shuffles the pointers, but they are all dead now. */
+        batch_free(&trace->blocks[index], trace->ops[i].count);
         break;
 
       default:
@@ -724,6 +1850,28 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
   return 1;
 }
 
+/*
+ * sample_timeline - Print a CSV row with the heap after ops requests of the
+ *     util run, and add it to the averages. External fragmentation is the
+ *     share of free bytes outside the largest free block.
+ */
+static void sample_timeline(trace_t *trace, int ops, int live) {
+  mm_stats_t s;
+  size_t heapsize = mem_heapsize();
+
+  mm_stats(&s);
+  if (!trace->samples)
+    printf("ops,live,heap,free,free_blocks,largest_free\n");
+  printf("%d,%d,%zu,%lu,%lu,%lu\n", ops, live, heapsize, s.free_bytes,
+         s.free_blocks, s.largest_free);
+
+  trace->samples++;
+  if (heapsize)
+    trace->util_sum += (double)live / heapsize;
+  if (s.free_bytes)
+    trace->frag_sum += 1.0 - (double)s.largest_free / s.free_bytes;
+}
+
 /*
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
@@ -739,8 +1887,13 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
 static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
   int max_total_size = 0;
   int total_size = 0;
+  int peak = alloc_stats ? peak_ops(trace) : -1;
 
+  if ((alloc_stats || timeline) && !mm_stats)
+    app_error("-S and -T need mm_stats\n");
   reinit_trace(trace);
+  trace->samples = 0;
+  trace->util_sum = trace->frag_sum = 0;
 
   /* initialize the heap and the mm malloc package */
   mem_reset_brk();
@@ -756,8 +1909,10 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
-        if ((p = mm_malloc(size)) == NULL)
+        if ((p = trace_malloc(&trace->ops[i])) == NULL)
           app_error("trace: mm_malloc failed in eval_mm_util");
+        count_straddle(trace, p, size);
+        count_lifetime(trace, &trace->ops[i], p);
 
         /* Remember region and size */
         trace->blocks[index] = p;
@@ -774,6 +1929,7 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
         oldp = trace->blocks[index];
         if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
           app_error("trace: mm_realloc failed in eval_mm_util");
+        count_straddle(trace, newp, newsize);
 
         /* Remember region and size */
         trace->blocks[index] = newp;
@@ -797,6 +1953,44 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
         total_size -= size;
         break;
 
+      case ALIGNED_ALLOC: /* mm_memalign */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
+        if ((p = aligned_malloc(trace->ops[i].align, size)) == NULL)
+          app_error("trace: mm_memalign failed in eval_mm_util");
+        count_straddle(trace, p, size);
+
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+
+        total_size += size;
+        break;
+
+      case BATCH_ALLOC: /* mm_malloc_batch */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
+        if (batch_malloc(size, trace->ops[i].count, &trace->blocks[index]) <
+            trace->ops[i].count)
+          app_error("trace: mm_malloc_batch failed in eval_mm_util");
+
+        for (int j = index; j < index + trace->ops[i].count; j++) {
+          trace->block_sizes[j] = size;
+          count_straddle(trace, trace->blocks[j], size);
+        }
+
+        total_size += size * trace->ops[i].count;
+        break;
+
+      case BATCH_FREE: /* mm_free_batch */
+        index = trace->ops[i].index;
+        for (int j = index; j < index + trace->ops[i].count; j++)
+          total_size -= trace->block_sizes[j];
+
+        batch_free(&trace->blocks[index], trace->ops[i].count);
+        break;
+
       default:
         app_error("trace: Nonexistent request type in eval_mm_util");
     }
@@ -804,12 +1998,21 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
     /* update the high-water mark */
     max_total_size =
       (total_size > max_total_size) ? total_size : max_total_size;
+
+    if (i + 1 == peak)
+      mm_stats(&trace->at_peak);
+    if (timeline && ((i + 1) % timeline == 0 || i + 1 == trace->num_ops))
+      sample_timeline(trace, i + 1, total_size);
   }
 
+  if (alloc_stats)
+    trace->counted = mm_stats(&trace->at_end) == 0;
+
+  /* The heap may have been trimmed since its peak. */
   *used_p = max_total_size;
-  *total_p = mem_heapsize();
+  *total_p = mem_heap_peak();
 
-  return ((double)max_total_size / (double)mem_heapsize());
+  return ((double)max_total_size / (double)mem_heap_peak());
 }
 
 /*
@@ -834,7 +2037,7 @@ static void eval_mm_speed(void *ptr) {
       case ALLOC: /* mm_malloc */
         index = trace->ops[i].index;
         size = trace->ops[i].size;
-        if ((p = mm_malloc(size)) == NULL)
+        if ((p = trace_malloc(&trace->ops[i])) == NULL)
           app_error("mm_malloc error in eval_mm_speed");
         trace->blocks[index] = p;
         break;
@@ -858,6 +2061,27 @@ static void eval_mm_speed(void *ptr) {
         mm_free(block);
         break;
 
+      case ALIGNED_ALLOC: /* mm_memalign */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = aligned_malloc(trace->ops[i].align, size)) == NULL)
+          app_error("mm_memalign error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
+      case BATCH_ALLOC: /* mm_malloc_batch */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if (batch_malloc(size, trace->ops[i].count, &trace->blocks[index]) <
+            trace->ops[i].count)
+          app_error("mm_malloc_batch error in eval_mm_speed");
+        break;
+
+      case BATCH_FREE: /* mm_free_batch */
+        index = trace->ops[i].index;
+        batch_free(&trace->blocks[index], trace->ops[i].count);
+        break;
+
       default:
         app_error("Nonexistent request type in eval_mm_speed");
     }
@@ -883,6 +2107,7 @@ static int eval_libc_valid(trace_t *trace) {
           malloc_error(trace, i, "libc malloc failed");
           unix_error("System message");
         }
+        count_straddle(trace, p, trace->ops[i].size);
         trace->blocks[trace->ops[i].index] = p;
         break;
 
@@ -893,6 +2118,7 @@ static int eval_libc_valid(trace_t *trace) {
           malloc_error(trace, i, "libc realloc failed");
           unix_error("System message");
         }
+        count_straddle(trace, newp, newsize);
         trace->blocks[trace->ops[i].index] = newp;
         break;
 
@@ -904,6 +2130,32 @@ static int eval_libc_valid(trace_t *trace) {
         }
         break;
 
+      case ALIGNED_ALLOC: /* aligned_alloc */
+        if ((p = aligned_alloc(trace->ops[i].align, trace->ops[i].size)) ==
+            NULL) {
+          malloc_error(trace, i, "libc aligned_alloc failed");
+          unix_error("System message");
+        }
+        count_straddle(trace, p, trace->ops[i].size);
+        trace->blocks[trace->ops[i].index] = p;
+        break;
+
+      case BATCH_ALLOC: /* malloc of each block */
+        for (int j = 0; j < trace->ops[i].count; j++) {
+          if ((p = malloc(trace->ops[i].size)) == NULL) {
+            malloc_error(trace, i, "libc malloc failed");
+            unix_error("System message");
+          }
+          count_straddle(trace, p, trace->ops[i].size);
+          trace->blocks[trace->ops[i].index + j] = p;
+        }
+        break;
+
+      case BATCH_FREE: /* free of each block */
+        for (int j = 0; j < trace->ops[i].count; j++)
+          free(trace->blocks[trace->ops[i].index + j]);
+        break;
+
       default:
         app_error("invalid operation type  in eval_libc_valid");
     }
@@ -954,6 +2206,28 @@ static void eval_libc_speed(void *ptr) {
           free(0);
         }
         break;
+
+      case ALIGNED_ALLOC: /* aligned_alloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = aligned_alloc(trace->ops[i].align, size)) == NULL)
+          unix_error("aligned_alloc failed in eval_libc_speed");
+        trace->blocks[index] = p;
+        break;
+
+      case BATCH_ALLOC: /* malloc of each block */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        for (int j = 0; j < trace->ops[i].count; j++)
+          if ((trace->blocks[index + j] = malloc(size)) == NULL)
+            unix_error("malloc failed in eval_libc_speed");
+        break;
+
+      case BATCH_FREE: /* free of each block */
+        index = trace->ops[i].index;
+        for (int j = 0; j < trace->ops[i].count; j++)
+          free(trace->blocks[index + j]);
+        break;
     }
   }
 }
@@ -962,6 +2236,36 @@ static void eval_libc_speed(void *ptr) {
  * Some miscellaneous helper routines
  ************************************/
 
+/*
+ * print_alloc_stats - Counters of mm at the end of the util run and its
+ *     free space when the most bytes were live
+ */
+static void print_alloc_stats(stats_t *stats) {
+  mm_counters_t *c = &stats->at_end.counters;
+  mm_stats_t *s = &stats->at_peak;
+
+  if (stats->counted) {
+    printf("%14lu mallocs %lu frees\n", c->mallocs, c->frees);
+    printf("%14lu reallocs in place, %lu moved, %lu bytes copied\n",
+           c->reallocs_inplace, c->reallocs_moved, c->bytes_copied);
+    printf("%14lu fit probes (%.2f per malloc), %lu splits\n", c->fit_probes,
+           c->mallocs ? (double)c->fit_probes / c->mallocs : 0, c->splits);
+    printf("%14lu heap extensions by %lu bytes\n", c->extensions,
+           c->extended_bytes);
+    printf("%14s %lu alone, %lu with next, %lu with prev, %lu with both\n",
+           "coalesce", c->coalesce[0], c->coalesce[1], c->coalesce[2],
+           c->coalesce[3]);
+  }
+  printf("%14s %lu free bytes in %lu blocks, largest %lu\n", "at peak:",
+         s->free_bytes, s->free_blocks, s->largest_free);
+  for (unsigned k = 0; k < s->nclasses; k++) {
+    if (!s->class_free[k])
+      continue;
+    printf("%14s %2u: %8lu free bytes in blocks up to %lu\n", "class", k,
+           s->class_free[k], s->class_size[k]);
+  }
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -1012,6 +2316,34 @@ static void printresults(stats_t *stats) {
     printf("%8s%10s%7s", "--", "--", "--");
 
   printf(" %s\n", stats->filename);
+
+  if (stats->small)
+    printf("%13.1f%% of %d small blocks cross a cache line\n",
+           100.0 * stats->straddle / stats->small, stats->small);
+
+  if (stats->bumped)
+    printf("%13.1f%% of %d blocks short-lived, %d placed as such, "
+           "%.1f%% right\n",
+           100.0 * stats->young / stats->allocs, stats->allocs,
+           stats->bumped, 100.0 * stats->hits / stats->allocs);
+
+  if (stats->samples)
+    printf("%13.1f%% util and %.1f%% external fragmentation on average "
+           "over %d samples\n",
+           100.0 * stats->avg_util, 100.0 * stats->avg_frag, stats->samples);
+
+  if (alloc_stats)
+    print_alloc_stats(stats);
+
+  if (perf_counters) {
+    if (!stats->perf_valid) {
+      printf("perf counters unavailable\n");
+      return;
+    }
+    for (int i = 0; i < 3; i++)
+      printf("%14lld %-12s (%.2f per op)\n", stats->perf[i],
+             perf_events[i].name, stats->perf[i] / stats->ops);
+  }
 }
 
 /*
@@ -1054,12 +2386,30 @@ static void malloc_error(const trace_t *trace, int opnum, const char *fmt,
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hlVD] [-d <i>] [-v <i>] [-f <file>]\n");
+  fprintf(stderr, "Usage: mdriver [-hlVDpALCS] [-d <i>] [-v <i>] [-P <n>] "
+                  "[-B <n>] [-T <k>] [-E <file>]\n"
+                  "               [-f <file>]\n");
   fprintf(stderr, "Options\n");
   fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
   fprintf(stderr, "\t-D         Equivalent to -d2.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
   fprintf(stderr, "\t-l         Run libc malloc instead mm.\n");
+  fprintf(stderr, "\t-p         Count cache misses in the timed run.\n");
+  fprintf(stderr, "\t-P <n>     Cross-thread free benchmark, up to <n> "
+                  "producers and consumers.\n");
+  fprintf(stderr, "\t-A         Arena benchmark, malloc and free against "
+                  "mm arenas.\n");
+  fprintf(stderr, "\t-B <n>     Footprint benchmark, up to <n> threads "
+                  "taking turns.\n");
+  fprintf(stderr, "\t-L         Tell mm the lifetime of every block, as "
+                  "found in the trace.\n");
+  fprintf(stderr, "\t-C         Compaction benchmark, the trace with "
+                  "movable blocks.\n");
+  fprintf(stderr, "\t-S         Print allocator counters and free space "
+                  "of the trace.\n");
+  fprintf(stderr, "\t-T <k>     Print the heap every <k> ops as CSV, "
+                  "with averages.\n");
+  fprintf(stderr, "\t-E <file>  Dump mm events of the trace to <file>.\n");
   fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
   fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
   fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
@@ -16,55 +16,114 @@
 
 /* private variables */
 static unsigned char *heap;
-static unsigned char *mem_brk;
-static unsigned char *mem_max_addr;
+static unsigned char *mem_brk[MAX_REGIONS]; /* brk of every region */
+static long mem_total;                      /* bytes taken by all regions */
+static long mem_peak;                       /* most mem_total has been */
+
+#define region_lo(i) (heap + (size_t)(i)*MAX_HEAP)
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
-  heap = mmap((void *)0x800000000,    /* suggested start */
-              MAX_HEAP,               /* length */
-              PROT_WRITE,             /* permissions */
-              MAP_PRIVATE | MAP_ANON, /* private or shared? */
-              -1,                     /* fd */
-              0);                     /* offset (dunno) */
-  mem_max_addr = heap + MAX_HEAP;
-  mem_brk = heap; /* heap is empty initially */
+  heap = mmap((void *)0x800000000,       /* suggested start */
+              (size_t)MAX_REGIONS * MAX_HEAP, /* length */
+              PROT_WRITE,                     /* permissions */
+              MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, /* private or shared? */
+              -1,                             /* fd */
+              0);                             /* offset (dunno) */
+  mem_reset_brk(); /* heap is empty initially */
 }
 
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
-  munmap(heap, MAX_HEAP);
+  munmap(heap, (size_t)MAX_REGIONS * MAX_HEAP);
 }
 
 /*
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
  */
 void mem_reset_brk() {
-  mem_brk = heap;
+  for (int i = 0; i < MAX_REGIONS; i++)
+    mem_brk[i] = region_lo(i);
+  mem_total = mem_peak = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap cannot be shrunk, see mem_region_trim.
  */
 void *mem_sbrk(long incr) {
-  unsigned char *old_brk = mem_brk;
+  return mem_region_sbrk(0, incr);
+}
 
-  if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+/*
+ * mem_region_sbrk - mem_sbrk for given region. Different regions may be
+ *    grown by different threads at the same time.
+ */
+void *mem_region_sbrk(int region, long incr) {
+  unsigned char *old_brk = mem_brk[region];
+
+  long total;
+
+  if ((incr < 0) ||
+      (total = __atomic_add_fetch(&mem_total, incr, __ATOMIC_RELAXED)) >
+        MAX_HEAP) {
+    if (incr >= 0)
+      __atomic_sub_fetch(&mem_total, incr, __ATOMIC_RELAXED);
     errno = ENOMEM;
     fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
     return (void *)-1;
   }
 
-  mem_brk += incr;
+  long peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+  while (total > peak &&
+         !__atomic_compare_exchange_n(&mem_peak, &peak, total, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  mem_brk[region] += incr;
   return (void *)old_brk;
 }
 
+/*
+ * mem_region_trim - gives back the last decr bytes of given region.
+ *    Returns -1 if the region is smaller than that.
+ */
+int mem_region_trim(int region, long decr) {
+  if (decr < 0 || decr > mem_brk[region] - region_lo(region)) {
+    errno = EINVAL;
+    return -1;
+  }
+  mem_brk[region] -= decr;
+  __atomic_sub_fetch(&mem_total, decr, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ * mem_region_lo - return address of the first byte of given region
+ */
+void *mem_region_lo(int region) {
+  return (void *)region_lo(region);
+}
+
+/*
+ * mem_region_size - returns the size of given region in bytes
+ */
+size_t mem_region_size(int region) {
+  return (size_t)(mem_brk[region] - region_lo(region));
+}
+
+/*
+ * mem_region_of - returns the region ptr points into
+ */
+int mem_region_of(void *ptr) {
+  return ((unsigned char *)ptr - heap) / MAX_HEAP;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -73,17 +132,28 @@ void *mem_heap_lo() {
 }
 
 /*
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte, in the last region
+ *    that is not empty
  */
 void *mem_heap_hi() {
-  return (void *)(mem_brk - 1);
+  int i = MAX_REGIONS - 1;
+  while (i > 0 && mem_brk[i] == region_lo(i))
+    i--;
+  return (void *)(mem_brk[i] - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, summed over regions
  */
 size_t mem_heapsize() {
-  return (size_t)((void *)mem_brk - (void *)heap);
+  return (size_t)mem_total;
+}
+
+/*
+ * mem_heap_peak() - returns the largest heap size since the last reset
+ */
+size_t mem_heap_peak() {
+  return (size_t)mem_peak;
 }
 
 /*
@@ -19,4 +19,18 @@ void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heap_peak(void);
 size_t mem_pagesize(void);
+
+/*
+ * Regions are independent heaps with a brk of their own, MAX_HEAP bytes
+ * apart in the address space. Region 0 is the heap mem_sbrk grows. All of
+ * them together may take at most MAX_HEAP bytes.
+ */
+#define MAX_REGIONS 16
+
+void *mem_region_sbrk(int region, long incr);
+void *mem_region_lo(int region);
+size_t mem_region_size(int region);
+int mem_region_of(void *ptr);
+int mem_region_trim(int region, long decr);
@@ -0,0 +1,556 @@
+/*Jakub Chomiczewski 329713*/
+
+/*
+ * Binary buddy variant.
+ *
+ * Blocks are 2^k bytes, k in [MIN_ORDER, MAX_ORDER], and aligned to their
+ * size relative to heap_base, so the buddy of a block is found by flipping
+ * one bit of its offset. For every pair of buddies of every order there is
+ * one bit telling whether exactly one of them is free. Freeing toggles it
+ * and, if that cleared the bit, both halves are free and get merged.
+ *
+ * Requests that fit in SLAB_OBJ_MAX go to a front end of slabs. A slab is
+ * a MIN_ORDER block cut into objects of one class from mm-classes.h. Big
+ * requests get a block with a BLK_HDR header holding its order, so the
+ * payload starts BLK_HDR bytes into a MIN_ORDER-aligned block. Slab objects
+ * never start there, which is how free() tells them apart.
+ *
+ * The heap grows by carving the area past the break into aligned blocks
+ * and freeing them, so they merge with free buddies below like any other
+ * block. Huge requests that no free block can serve are cut from the top
+ * without padding it to their alignment first, and given back as a series
+ * of aligned blocks when freed.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mm-classes.h"
+
+/* If you want debugging output, use the following macro.
+ * When you hand in, remove the #define DEBUG line. */
+// #define DEBUG
+#ifdef DEBUG
+#define debug(fmt, ...) printf("%s: " fmt "\n", __func__, __VA_ARGS__)
+#define msg(...) printf(__VA_ARGS__)
+#else
+#define debug(fmt, ...)
+#define msg(...)
+#endif
+
+#define __unused __attribute__((unused))
+
+/* do not change the following! */
+#ifdef DRIVER
+/* create aliases for driver tests */
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#endif /* !DRIVER */
+
+#define MIN_ORDER 12
+#define MAX_ORDER 27 /* 128MiB, covers MAX_HEAP */
+#define NORDERS (MAX_ORDER - MIN_ORDER + 1)
+#define MIN_BLOCK (1UL << MIN_ORDER)
+
+/* Bits of the pair bitmap needed below given order: pairs of order k start
+ * at bit pair_base(k). */
+#define PAIR_BITS (1UL << (MAX_ORDER - MIN_ORDER))
+#define pair_base(k) (PAIR_BITS - (PAIR_BITS >> ((k)-MIN_ORDER)))
+
+#define HUGE_ORDER 20
+#define BLK_HDR 16
+#define SLAB_HDR 32
+#define SLAB_OBJ_MAX ((MIN_BLOCK - SLAB_HDR) / 2)
+
+/* Big block header, the payload follows at BLK_HDR. */
+typedef struct {
+  uint32_t order; /* 0 for huge blocks */
+  uint32_t size;  /* bytes of a huge block */
+  uint32_t magic; /* BLK_MAGIC, where a slab has an offset */
+} blk_t;
+
+#define BLK_MAGIC 0xb10cb10c
+
+/* Free blocks are doubly linked by offsets, offset 0 is the heap header so
+ * it doubles as NULL. */
+typedef struct {
+  uint32_t prev;
+  uint32_t next;
+} node_t;
+
+/* Slab header at the start of its MIN_ORDER block. */
+typedef struct {
+  uint32_t prev; /* partial list of the class */
+  uint32_t next;
+  uint32_t free; /* first free object */
+  uint32_t bump; /* first object never handed out */
+  uint16_t inuse;
+  uint8_t sclass;
+} slab_t;
+
+/* Heap header, first block of the heap. */
+typedef struct {
+  uint32_t free_list[NORDERS];
+  uint32_t nonempty; /* bit k - MIN_ORDER set iff free_list is not empty */
+  uint32_t top;      /* offset of the break */
+  uint32_t partial[NCLASSES];
+  uint64_t pairs[PAIR_BITS / 64];
+} heap_t;
+
+static void *heap_base = NULL;
+static heap_t *heap = NULL;
+
+#define round_up(size) ((size + ALIGNMENT - 1) & -ALIGNMENT)
+
+/* --=[ buddy blocks ]=----------------------------------------------------- */
+
+static inline void *from_offset(uint32_t offset) {
+  return heap_base + offset;
+}
+
+static inline uint32_t to_offset(void *ptr) {
+  return ptr - heap_base;
+}
+
+/* Toggles the bit of the pair containing block at offset, returns the new
+ * value: 1 means only one of the buddies is free now. */
+static inline int pair_toggle(uint32_t offset, int k) {
+  size_t bit = pair_base(k) + (offset >> (k + 1));
+  heap->pairs[bit >> 6] ^= 1UL << (bit & 63);
+  return (heap->pairs[bit >> 6] >> (bit & 63)) & 1;
+}
+
+static inline bool pair_test(uint32_t offset, int k) {
+  size_t bit = pair_base(k) + (offset >> (k + 1));
+  return (heap->pairs[bit >> 6] >> (bit & 63)) & 1;
+}
+
+static inline void list_push(int k, uint32_t offset) {
+  uint32_t *head = &heap->free_list[k - MIN_ORDER];
+  node_t *node = from_offset(offset);
+  node->prev = 0;
+  node->next = *head;
+  if (*head)
+    ((node_t *)from_offset(*head))->prev = offset;
+  *head = offset;
+  heap->nonempty |= 1U << (k - MIN_ORDER);
+}
+
+static inline void list_remove(int k, uint32_t offset) {
+  uint32_t *head = &heap->free_list[k - MIN_ORDER];
+  node_t *node = from_offset(offset);
+  if (node->prev)
+    ((node_t *)from_offset(node->prev))->next = node->next;
+  else
+    *head = node->next;
+  if (node->next)
+    ((node_t *)from_offset(node->next))->prev = node->prev;
+  if (!*head)
+    heap->nonempty &= ~(1U << (k - MIN_ORDER));
+}
+
+/* Frees block of order k, merging it with its buddy as long as the buddy
+ * is free too. */
+static void buddy_free(uint32_t offset, int k) {
+  while (k < MAX_ORDER && !pair_toggle(offset, k)) {
+    uint32_t buddy = offset ^ (1U << k);
+    list_remove(k, buddy);
+    offset &= ~(1U << k);
+    k++;
+  }
+  list_push(k, offset);
+}
+
+/* Extends the heap with aligned blocks until one of order >= k is free. */
+static bool buddy_grow(int k) {
+  while (!(heap->nonempty >> (k - MIN_ORDER))) {
+    uint32_t top = heap->top;
+    int j = top ? __builtin_ctz(top) : MAX_ORDER;
+    if (j > k)
+      j = k;
+    if ((long)mem_sbrk(1UL << j) < 0)
+      return false;
+    heap->top += 1U << j;
+    buddy_free(top, j);
+  }
+  return true;
+}
+
+/* Frees a MIN_BLOCK-aligned range as the largest aligned blocks it has. */
+static void buddy_release(uint32_t offset, uint32_t size) {
+  while (size) {
+    int j = __builtin_ctz(offset | (1U << MAX_ORDER));
+    int n = 31 - __builtin_clz(size);
+    if (j > n)
+      j = n;
+    buddy_free(offset, j);
+    offset += 1U << j;
+    size -= 1U << j;
+  }
+}
+
+static uint32_t buddy_alloc(int k) {
+  if (!(heap->nonempty >> (k - MIN_ORDER)) && !buddy_grow(k))
+    return 0;
+
+  int j = k + __builtin_ctz(heap->nonempty >> (k - MIN_ORDER));
+  uint32_t offset = heap->free_list[j - MIN_ORDER];
+  list_remove(j, offset);
+  if (j < MAX_ORDER)
+    pair_toggle(offset, j);
+
+  /* Split, giving back the upper halves. */
+  while (j > k) {
+    j--;
+    list_push(j, offset + (1U << j));
+    pair_toggle(offset, j);
+  }
+  return offset;
+}
+
+static inline int order_of(size_t size) {
+  if (size <= MIN_BLOCK)
+    return MIN_ORDER;
+  return 64 - __builtin_clzl(size - 1);
+}
+
+/* --=[ slabs ]=------------------------------------------------------------ */
+
+static inline bool slab_full(slab_t *slab) {
+  return !slab->free && slab->bump + class_size[slab->sclass] >
+                          (to_offset(slab) | (MIN_BLOCK - 1)) + 1;
+}
+
+static inline void partial_push(slab_t *slab) {
+  uint32_t *head = &heap->partial[slab->sclass];
+  slab->prev = 0;
+  slab->next = *head;
+  if (*head)
+    ((slab_t *)from_offset(*head))->prev = to_offset(slab);
+  *head = to_offset(slab);
+}
+
+static inline void partial_remove(slab_t *slab) {
+  uint32_t *head = &heap->partial[slab->sclass];
+  if (slab->prev)
+    ((slab_t *)from_offset(slab->prev))->next = slab->next;
+  else
+    *head = slab->next;
+  if (slab->next)
+    ((slab_t *)from_offset(slab->next))->prev = slab->prev;
+}
+
+static void *slab_alloc(int k) {
+  slab_t *slab;
+
+  if (heap->partial[k]) {
+    slab = from_offset(heap->partial[k]);
+  } else {
+    uint32_t offset = buddy_alloc(MIN_ORDER);
+    if (!offset)
+      return NULL;
+    slab = from_offset(offset);
+    slab->sclass = k;
+    slab->free = 0;
+    slab->bump = offset + SLAB_HDR;
+    slab->inuse = 0;
+    partial_push(slab);
+  }
+
+  void *obj;
+  if (slab->free) {
+    obj = from_offset(slab->free);
+    slab->free = *(uint32_t *)obj;
+  } else {
+    obj = from_offset(slab->bump);
+    slab->bump += class_size[k];
+  }
+  slab->inuse++;
+
+  if (slab_full(slab))
+    partial_remove(slab);
+
+  return obj;
+}
+
+static void slab_free(slab_t *slab, void *obj) {
+  if (slab_full(slab))
+    partial_push(slab);
+
+  *(uint32_t *)obj = slab->free;
+  slab->free = to_offset(obj);
+  slab->inuse--;
+
+  /* Keep the last slab of a class, like mm-span.c does. */
+  if (!slab->inuse && (slab->prev || slab->next)) {
+    partial_remove(slab);
+    buddy_free(to_offset(slab), MIN_ORDER);
+  }
+}
+
+/* --=[ mm_init ]=---------------------------------------------------------- */
+
+int mm_init(void) {
+  size_t pad = -(size_t)mem_sbrk(0) & (MIN_BLOCK - 1);
+  if ((long)mem_sbrk(pad) < 0)
+    return -1;
+
+  /* The header takes the first block and is never freed. */
+  int k = order_of(sizeof(heap_t));
+  heap_base = mem_sbrk(1UL << k);
+  if ((long)heap_base < 0)
+    return -1;
+
+  heap = heap_base;
+  memset(heap, 0, sizeof(heap_t));
+  heap->top = 1U << k;
+  return 0;
+}
+
+/* --=[ malloc ]=----------------------------------------------------------- */
+
+void *malloc(size_t size) {
+  /* Before rounding, which could wrap it around. */
+  if (size > (1UL << MAX_ORDER) - BLK_HDR)
+    return NULL;
+
+  size_t bsize = round_up(size);
+  int sclass = size_class(bsize ? bsize : ALIGNMENT);
+
+  if (class_size[sclass] <= SLAB_OBJ_MAX)
+    return slab_alloc(sclass);
+
+  int k = order_of(size + BLK_HDR);
+  blk_t *blk;
+  if (k >= HUGE_ORDER && !(heap->nonempty >> (k - MIN_ORDER))) {
+    size_t bytes = (size + BLK_HDR + MIN_BLOCK - 1) & -MIN_BLOCK;
+    blk = mem_sbrk(bytes);
+    if ((long)blk < 0)
+      return NULL;
+    heap->top += bytes;
+    blk->order = 0;
+    blk->size = bytes;
+  } else {
+    uint32_t offset = buddy_alloc(k);
+    if (!offset)
+      return NULL;
+    blk = from_offset(offset);
+    blk->order = k;
+  }
+  blk->magic = BLK_MAGIC;
+  return (void *)blk + BLK_HDR;
+}
+
+/* --=[ free ]=------------------------------------------------------------- */
+
+static inline bool is_block(void *ptr) {
+  return (to_offset(ptr) & (MIN_BLOCK - 1)) == BLK_HDR;
+}
+
+void free(void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  if (is_block(ptr)) {
+    blk_t *blk = ptr - BLK_HDR;
+    if (blk->order)
+      buddy_free(to_offset(blk), blk->order);
+    else
+      buddy_release(to_offset(blk), blk->size);
+  } else {
+    slab_free(from_offset(to_offset(ptr) & ~(MIN_BLOCK - 1)), ptr);
+  }
+}
+
+/* --=[ realloc ]=---------------------------------------------------------- */
+
+/* Grows a big block in place while it is the lower half of its pair and
+ * the upper half is free as a whole. */
+static bool block_expand(blk_t *blk, size_t size) {
+  uint32_t offset = to_offset(blk);
+  int j = blk->order;
+  int k = order_of(size + BLK_HDR);
+
+  /* A huge block at the top just moves the break. */
+  if (!j) {
+    size_t bytes = (size + BLK_HDR + MIN_BLOCK - 1) & -MIN_BLOCK;
+    if (offset + blk->size != heap->top ||
+        (long)mem_sbrk(bytes - blk->size) < 0)
+      return false;
+    heap->top += bytes - blk->size;
+    blk->size = bytes;
+    return true;
+  }
+
+  for (int i = j; i < k; i++)
+    if ((offset & (1U << i)) || !pair_test(offset, i) ||
+        offset + (2U << i) > heap->top)
+      return false;
+
+  for (; j < k; j++) {
+    list_remove(j, offset + (1U << j));
+    pair_toggle(offset, j);
+  }
+  blk->order = k;
+  return true;
+}
+
+void *realloc(void *old_ptr, size_t size) {
+  /* If size == 0 then this is just free, and we return NULL. */
+  if (size == 0) {
+    free(old_ptr);
+    return NULL;
+  }
+
+  /* If old_ptr is NULL, then this is just malloc. */
+  if (!old_ptr)
+    return malloc(size);
+
+  size_t old_size;
+  if (is_block(old_ptr)) {
+    blk_t *blk = old_ptr - BLK_HDR;
+    old_size = (blk->order ? 1UL << blk->order : blk->size) - BLK_HDR;
+    if (size <= old_size)
+      return old_ptr;
+    if (size <= (1UL << MAX_ORDER) - BLK_HDR &&
+        block_expand(blk, size))
+      return old_ptr;
+  } else {
+    slab_t *slab = from_offset(to_offset(old_ptr) & ~(MIN_BLOCK - 1));
+    old_size = class_size[slab->sclass];
+    if (size <= old_size)
+      return old_ptr;
+  }
+
+  void *new_ptr = malloc(size);
+
+  /* If malloc() fails, the original block is left untouched. */
+  if (!new_ptr)
+    return NULL;
+
+  /* Copy the old data. */
+  memcpy(new_ptr, old_ptr, old_size);
+
+  /* Free the old block. */
+  free(old_ptr);
+
+  return new_ptr;
+}
+
+/* --=[ calloc ]=----------------------------------------------------------- */
+
+void *calloc(size_t nmemb, size_t size) {
+  size_t bytes = nmemb * size;
+  void *new_ptr = malloc(bytes);
+  if (new_ptr)
+    memset(new_ptr, 0, bytes);
+  return new_ptr;
+}
+
+/* --=[ mm_checkheap ]=----------------------------------------------------- */
+
+/* A broken heap can not be trusted with anything, so the first problem
+ * found ends the program. */
+static void check_fail(uint32_t offset, const char *what) {
+  fprintf(stderr, "mm_checkheap: block at offset %#x: %s\n", offset, what);
+  abort();
+}
+
+/* Checks a slab and returns whether it belongs on its partial list. */
+static bool check_slab(slab_t *slab) {
+  uint32_t start = to_offset(slab) + SLAB_HDR;
+  uint32_t end = to_offset(slab) + MIN_BLOCK;
+  size_t size = class_size[slab->sclass];
+  if (size > SLAB_OBJ_MAX)
+    check_fail(to_offset(slab), "slab of a class too big for slabs");
+  if (slab->bump < start || slab->bump > end || (slab->bump - start) % size)
+    check_fail(to_offset(slab), "slab bump pointer out of place");
+  uint32_t nfree = 0;
+  for (uint32_t o = slab->free; o; o = *(uint32_t *)from_offset(o)) {
+    if (o < start || o >= slab->bump || (o - start) % size)
+      check_fail(to_offset(slab), "free object outside its slab");
+    if (++nfree > MIN_BLOCK / ALIGNMENT)
+      check_fail(to_offset(slab), "free object list has a cycle");
+  }
+  if (slab->inuse + nfree != (slab->bump - start) / size)
+    check_fail(to_offset(slab), "slab objects in use do not add up");
+  return !slab_full(slab);
+}
+
+/* Marks the free blocks found on the lists, then walks the heap block by
+ * block from the header to the break. Free blocks are told apart by the
+ * marks, big blocks by BLK_MAGIC, anything else must be a slab. */
+void mm_checkheap(int verbose) {
+  static uint8_t free_order[(1UL << MAX_ORDER) / MIN_BLOCK];
+  uint32_t first = 1U << order_of(sizeof(heap_t));
+  size_t npartial = 0;
+
+  memset(free_order, 0, sizeof(free_order));
+  for (int k = MIN_ORDER; k <= MAX_ORDER; k++) {
+    uint32_t head = heap->free_list[k - MIN_ORDER];
+    if (!head != !(heap->nonempty & (1U << (k - MIN_ORDER))))
+      check_fail(head, "nonempty bit does not match the free list");
+    uint32_t prev = 0;
+    for (uint32_t o = head; o; o = ((node_t *)from_offset(o))->next) {
+      if (o < first || o + (1UL << k) > heap->top || o & ((1U << k) - 1))
+        check_fail(o, "free block outside the heap or misaligned");
+      if (((node_t *)from_offset(o))->prev != prev)
+        check_fail(o, "free block does not link back");
+      if (free_order[o >> MIN_ORDER])
+        check_fail(o, "free block on the lists twice");
+      if (k < MAX_ORDER && !pair_test(o, k))
+        check_fail(o, "free block whose buddy is free too");
+      free_order[o >> MIN_ORDER] = k;
+      prev = o;
+    }
+  }
+
+  for (int k = 0; k < NCLASSES; k++) {
+    uint32_t prev = 0;
+    for (uint32_t o = heap->partial[k]; o; o = ((slab_t *)from_offset(o))->next) {
+      slab_t *slab = from_offset(o);
+      if (slab->prev != prev || slab->sclass != k)
+        check_fail(o, "slab on the wrong partial list");
+      npartial++;
+      prev = o;
+    }
+  }
+
+  uint32_t offset = first;
+  while (offset < heap->top) {
+    blk_t *blk = from_offset(offset);
+    size_t size;
+    if (free_order[offset >> MIN_ORDER]) {
+      size = 1UL << free_order[offset >> MIN_ORDER];
+    } else if (blk->magic == BLK_MAGIC) {
+      size = blk->order ? 1UL << blk->order : blk->size;
+      if (blk->order ? blk->order < MIN_ORDER || blk->order > MAX_ORDER ||
+                         offset & (size - 1)
+                     : !size || size % MIN_BLOCK)
+        check_fail(offset, "bad big block order or size");
+    } else {
+      size = MIN_BLOCK;
+      if (check_slab(from_offset(offset)))
+        npartial--;
+    }
+    if (verbose)
+      printf("block %#x+%#zx %s\n", offset, size,
+             free_order[offset >> MIN_ORDER] ? "free" : "used");
+    if (offset + size > heap->top)
+      check_fail(offset, "block past the break");
+    offset += size;
+  }
+  if (npartial)
+    check_fail(0, "partial lists do not match the slabs with room");
+}
@@ -0,0 +1,76 @@
+/* mm-classes.h - size classes shared by the allocators.
+ *
+ * Generated by: ./gen-classes.py with 53 traces
+ * Do not edit, run gen-classes.py instead.
+ */
+#ifndef MM_CLASSES_H
+#define MM_CLASSES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NCLASSES 64
+/* First class that holds more than one block size. */
+#define FIRST_RANGE_CLASS 5
+
+#define CELL_SMALL_MAX 1024
+#define CELL_LARGE 65
+#define NCELLS 241
+
+/* Class of every cell. */
+static const uint8_t cell_class[NCELLS] = {
+  0, 0, 1, 2, 3, 4, 5, 5, 6, 7, 8, 8, 9, 9, 9, 9,
+  10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 11, 12, 12, 13, 14, 14,
+  14, 15, 16, 16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17,
+  17, 17, 17, 17, 17, 17, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18,
+  18, 19, 19, 20, 20, 21, 21, 21, 22, 22, 23, 23, 24, 24, 25, 25,
+  26, 27, 28, 28, 29, 29, 30, 30, 31, 32, 33, 34, 35, 36, 37, 38,
+  39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 48, 49, 49, 49, 49, 49,
+  49, 49, 49, 50, 50, 50, 50, 50, 51, 51, 51, 52, 52, 53, 53, 54,
+  54, 55, 56, 57, 58, 59, 60, 61, 61, 62, 63, 63, 63, 63, 63, 63,
+  63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
+  63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
+  63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
+  63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
+  63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
+  63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
+  63,
+};
+
+/* Largest block size that belongs to each class. */
+static const uint32_t class_size[NCLASSES] = {
+  16, 32, 48, 64, 80, 112,
+  128, 144, 176, 240, 320, 416,
+  448, 464, 512, 528, 672, 848,
+  1024, 1264, 1520, 1904, 2288, 2800,
+  3312, 3824, 4080, 4592, 5616, 6640,
+  7664, 8176, 9200, 10224, 11248, 12272,
+  13296, 14320, 15344, 16368, 18416, 20464,
+  22512, 24560, 26608, 28656, 30704, 32752,
+  40944, 81904, 122864, 163824, 196592, 229360,
+  262128, 294896, 327664, 360432, 393200, 425968,
+  458736, 524272, 589808, 4294967280,
+};
+
+/* Block sizes up to CELL_SMALL_MAX are indexed directly, bigger ones by
+ * their highest bit and the three bits below it. Both are computed and the
+ * right one is picked with a mask, so there is no branch to mispredict. */
+static inline unsigned size_cell(size_t size) {
+  unsigned e = 63 - __builtin_clzl(size | CELL_SMALL_MAX);
+  e = e < 31 ? e : 31;
+  unsigned large =
+    CELL_LARGE + ((e - 10) << 3) + ((size >> (e - 3)) & 7);
+  unsigned small = -(unsigned)(size <= CELL_SMALL_MAX);
+  return large ^ ((large ^ (unsigned)(size >> 4)) & small);
+}
+
+static inline int size_class(size_t size) {
+  return cell_class[size_cell(size)];
+}
+
+/* Block size a segregated storage tier hands out for given block size. */
+static inline size_t class_round(size_t size) {
+  return class_size[size_class(size)];
+}
+
+#endif /* !MM_CLASSES_H */
@@ -0,0 +1,689 @@
+/*Jakub Chomiczewski 329713*/
+
+/*
+ * Hoard-style variant.
+ *
+ * Memory is handed out in superblocks of SB_SIZE bytes, aligned to their
+ * size, so the superblock of any pointer is found by masking it. Each one
+ * is cut into objects of a single size class from mm-classes.h and is
+ * owned by one heap. Threads are spread over NHEAPS heaps, heap 0 is the
+ * global one.
+ *
+ * A heap counts bytes of objects it handed out (in_use) and bytes of its
+ * superblocks (held). Once a free leaves it with
+ *
+ *   in_use < held - EMPTY_SLACK * SB_SIZE  and  in_use < (1 - f) * held,
+ *
+ * with f = 1 / EMPTY_FRACTION, one superblock that is at least f empty
+ * moves to the global heap, where any other heap can take it. So memory
+ * freed by one thread does not stay stranded in its heap, and a heap holds
+ * at most a constant factor more than it uses.
+ *
+ * A heap keeps the superblocks of each class in fullness bins and
+ * allocates from the fullest one. Requests above OBJ_MAX get a run of
+ * whole superblocks of their own.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mm-classes.h"
+
+#ifdef THREADS
+#include <pthread.h>
+#include <time.h>
+#endif
+
+/* If you want debugging output, use the following macro.
+ * When you hand in, remove the #define DEBUG line. */
+// #define DEBUG
+#ifdef DEBUG
+#define debug(fmt, ...) printf("%s: " fmt "\n", __func__, __VA_ARGS__)
+#define msg(...) printf(__VA_ARGS__)
+#else
+#define debug(fmt, ...)
+#define msg(...)
+#endif
+
+#define __unused __attribute__((unused))
+
+/* do not change the following! */
+#ifdef DRIVER
+/* create aliases for driver tests */
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#endif /* !DRIVER */
+
+#define SB_SHIFT 14
+#define SB_SIZE (1 << SB_SHIFT)
+#define SB_HDR 32
+#define OBJ_MAX ((SB_SIZE - SB_HDR) / 2)
+
+#define NHEAPS 8         /* per-thread heaps, not counting the global one */
+#define NBINS 4          /* fullness bins, plus one for full superblocks */
+#define EMPTY_FRACTION 4 /* f */
+#define EMPTY_SLACK 4    /* K, superblocks a heap may always keep */
+
+typedef enum {
+  SB_FREE = 0,  /* in the unit allocator */
+  SB_SMALL = 1, /* objects of one size class */
+  SB_LARGE = 2, /* single big request */
+} sb_type;
+
+/* Superblock header. Links are offsets from hoard_base, offset 0 is the
+ * hoard header so it doubles as NULL. */
+typedef struct {
+  uint32_t prev;   /* bin of its heap, or list of free runs */
+  uint32_t next;
+  uint32_t free;   /* first free object */
+  uint32_t bump;   /* first object never handed out */
+  uint32_t nunits; /* length in superblocks */
+  uint16_t inuse;  /* objects handed out */
+  uint16_t capacity;
+  uint8_t type;   /* sb_type */
+  uint8_t sclass; /* size class */
+  uint8_t bin;    /* fullness bin */
+  uint8_t owner;  /* heap, changes only with the owner's lock held */
+} sb_t;
+
+typedef struct {
+#ifdef THREADS
+  pthread_mutex_t lock;
+  mm_heap_stats_t stats;
+#endif
+  size_t in_use; /* bytes of objects handed out from its superblocks */
+  size_t held;   /* bytes of its superblocks */
+  uint32_t bins[NCLASSES][NBINS + 1];
+} hheap_t;
+
+/* Lives in the first superblock-sized unit of the heap. */
+typedef struct {
+  hheap_t heaps[NHEAPS + 1];
+  uint32_t free_units; /* free runs of one unit */
+  uint32_t free_runs;  /* longer free runs */
+  size_t nunits;       /* units between hoard_base and brk */
+#ifdef THREADS
+  pthread_mutex_t unit_lock;
+  uint32_t next_heap;
+#endif
+} hoard_t;
+
+static void *hoard_base = NULL;
+static hoard_t *hoard = NULL;
+
+#ifdef THREADS
+static __thread int thread_heap; /* 0 until the thread's first malloc */
+#endif
+
+#define round_up(size) ((size + ALIGNMENT - 1) & -ALIGNMENT)
+
+/* --=[ superblocks ]=------------------------------------------------------ */
+
+static inline void *from_offset(uint32_t offset) {
+  return hoard_base + offset;
+}
+
+static inline uint32_t to_offset(void *ptr) {
+  return ptr - hoard_base;
+}
+
+static inline sb_t *sb_of(void *ptr) {
+  return hoard_base + ((ptr - hoard_base) & ~(SB_SIZE - 1));
+}
+
+static inline void list_push(uint32_t *head, sb_t *sb) {
+  sb->prev = 0;
+  sb->next = *head;
+  if (*head)
+    ((sb_t *)from_offset(*head))->prev = to_offset(sb);
+  *head = to_offset(sb);
+}
+
+static inline void list_remove(uint32_t *head, sb_t *sb) {
+  if (sb->prev)
+    ((sb_t *)from_offset(sb->prev))->next = sb->next;
+  else
+    *head = sb->next;
+  if (sb->next)
+    ((sb_t *)from_offset(sb->next))->prev = sb->prev;
+}
+
+static inline int sb_bin(sb_t *sb) {
+  if (sb->inuse == sb->capacity)
+    return NBINS;
+  return sb->inuse * NBINS / sb->capacity;
+}
+
+static inline void bin_insert(hheap_t *h, sb_t *sb) {
+  sb->bin = sb_bin(sb);
+  list_push(&h->bins[sb->sclass][sb->bin], sb);
+}
+
+static inline void bin_remove(hheap_t *h, sb_t *sb) {
+  list_remove(&h->bins[sb->sclass][sb->bin], sb);
+}
+
+static inline void bin_update(hheap_t *h, sb_t *sb) {
+  if (sb_bin(sb) != sb->bin) {
+    bin_remove(h, sb);
+    bin_insert(h, sb);
+  }
+}
+
+/* --=[ locking ]=---------------------------------------------------------- */
+
+/* Lock order: a thread's heap, then the global heap, then unit_lock. */
+#ifdef THREADS
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline void heap_lock(hheap_t *h) {
+  if (pthread_mutex_trylock(&h->lock)) {
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&h->lock);
+    h->stats.wait_ns += now_ns() - start;
+    h->stats.contended++;
+  }
+  h->stats.locks++;
+}
+
+static inline void heap_unlock(hheap_t *h) {
+  pthread_mutex_unlock(&h->lock);
+}
+
+static inline void units_lock(void) {
+  pthread_mutex_lock(&hoard->unit_lock);
+}
+
+static inline void units_unlock(void) {
+  pthread_mutex_unlock(&hoard->unit_lock);
+}
+
+static hheap_t *my_heap(void) {
+  if (!thread_heap) {
+    thread_heap = 1 + __atomic_fetch_add(&hoard->next_heap, 1,
+                                         __ATOMIC_RELAXED) % NHEAPS;
+    __atomic_fetch_add(&hoard->heaps[thread_heap].stats.threads, 1,
+                       __ATOMIC_RELAXED);
+  }
+  return &hoard->heaps[thread_heap];
+}
+#else
+static inline void heap_lock(hheap_t *h) {
+}
+
+static inline void heap_unlock(hheap_t *h) {
+}
+
+static inline void units_lock(void) {
+}
+
+static inline void units_unlock(void) {
+}
+
+static hheap_t *my_heap(void) {
+  return &hoard->heaps[1];
+}
+#endif
+
+/* --=[ units ]=------------------------------------------------------------ */
+
+/* Runs of nunits superblock-sized units, taken from free runs or from the
+ * top of the heap. Free runs are not merged. */
+static sb_t *units_alloc(uint32_t nunits) {
+  sb_t *sb = NULL;
+
+  units_lock();
+  if (nunits == 1 && hoard->free_units) {
+    sb = from_offset(hoard->free_units);
+    list_remove(&hoard->free_units, sb);
+  } else {
+    sb_t *fit = NULL;
+    for (uint32_t s = hoard->free_runs; s;) {
+      sb_t *run = from_offset(s);
+      if (run->nunits >= nunits && (!fit || run->nunits < fit->nunits))
+        fit = run;
+      s = run->next;
+    }
+    if (fit) {
+      list_remove(&hoard->free_runs, fit);
+      if (fit->nunits > nunits) {
+        sb_t *rest = (void *)fit + ((size_t)nunits << SB_SHIFT);
+        rest->type = SB_FREE;
+        rest->nunits = fit->nunits - nunits;
+        list_push(rest->nunits == 1 ? &hoard->free_units : &hoard->free_runs,
+                  rest);
+      }
+      sb = fit;
+    } else {
+      sb = mem_sbrk((size_t)nunits << SB_SHIFT);
+      if ((long)sb < 0)
+        sb = NULL;
+      else
+        hoard->nunits += nunits;
+    }
+  }
+  units_unlock();
+
+  if (sb)
+    sb->nunits = nunits;
+  return sb;
+}
+
+static void units_free(sb_t *sb) {
+  units_lock();
+  sb->type = SB_FREE;
+  list_push(sb->nunits == 1 ? &hoard->free_units : &hoard->free_runs, sb);
+  units_unlock();
+}
+
+/* --=[ heaps ]=------------------------------------------------------------ */
+
+static void sb_format(sb_t *sb, int k) {
+  sb->type = SB_SMALL;
+  sb->sclass = k;
+  sb->free = 0;
+  sb->bump = to_offset(sb) + SB_HDR;
+  sb->inuse = 0;
+  sb->capacity = (SB_SIZE - SB_HDR) / class_size[k];
+}
+
+/* Moves sb from heap from to heap to, both locked. */
+static void sb_move(hheap_t *from, hheap_t *to, sb_t *sb) {
+  size_t used = (size_t)sb->inuse * class_size[sb->sclass];
+  bin_remove(from, sb);
+  from->held -= SB_SIZE;
+  from->in_use -= used;
+  __atomic_store_n(&sb->owner, to - hoard->heaps, __ATOMIC_RELEASE);
+  to->held += SB_SIZE;
+  to->in_use += used;
+  bin_insert(to, sb);
+}
+
+/* Fullest superblock of class k that has room. */
+static sb_t *heap_find(hheap_t *h, int k) {
+  for (int b = NBINS - 1; b >= 0; b--)
+    if (h->bins[k][b])
+      return from_offset(h->bins[k][b]);
+  return NULL;
+}
+
+/* Any superblock with no objects, it can be reformatted for another class.
+ * Empty superblocks always sit in bin 0. */
+static sb_t *heap_find_empty(hheap_t *h) {
+  for (int k = 0; k < NCLASSES; k++) {
+    for (uint32_t s = h->bins[k][0]; s;) {
+      sb_t *sb = from_offset(s);
+      if (!sb->inuse)
+        return sb;
+      s = sb->next;
+    }
+  }
+  return NULL;
+}
+
+/* Gets a superblock of class k for heap h (locked): from the global heap
+ * if it has one, otherwise a fresh one. */
+static sb_t *heap_refill(hheap_t *h, int k) {
+  hheap_t *global = &hoard->heaps[0];
+  sb_t *sb;
+
+  heap_lock(global);
+  if ((sb = heap_find(global, k)) || (sb = heap_find_empty(global))) {
+    sb_move(global, h, sb);
+    heap_unlock(global);
+    if (sb->sclass != k) {
+      bin_remove(h, sb);
+      sb_format(sb, k);
+      bin_insert(h, sb);
+    }
+    return sb;
+  }
+  heap_unlock(global);
+
+  if (!(sb = units_alloc(1)))
+    return NULL;
+  sb_format(sb, k);
+  sb->owner = h - hoard->heaps;
+  h->held += SB_SIZE;
+  bin_insert(h, sb);
+  return sb;
+}
+
+/* The emptiness invariant, checked after every free into a thread heap. */
+static void heap_release(hheap_t *h) {
+  if (h->in_use + EMPTY_SLACK * SB_SIZE >= h->held ||
+      h->in_use * EMPTY_FRACTION >= h->held * (EMPTY_FRACTION - 1))
+    return;
+
+  /* Bin 0 superblocks are at most 1/NBINS full, so at least f empty. */
+  for (int k = 0; k < NCLASSES; k++) {
+    if (h->bins[k][0]) {
+      hheap_t *global = &hoard->heaps[0];
+      heap_lock(global);
+      sb_move(h, global, from_offset(h->bins[k][0]));
+      heap_unlock(global);
+      return;
+    }
+  }
+}
+
+/* --=[ mm_init ]=---------------------------------------------------------- */
+
+int mm_init(void) {
+  size_t pad = -(size_t)mem_sbrk(0) & (SB_SIZE - 1);
+  if ((long)mem_sbrk(pad) < 0)
+    return -1;
+
+  size_t size = (sizeof(hoard_t) + SB_SIZE - 1) & ~(SB_SIZE - 1);
+  hoard_base = mem_sbrk(size);
+  if ((long)hoard_base < 0)
+    return -1;
+
+  hoard = hoard_base;
+  memset(hoard, 0, sizeof(hoard_t));
+  hoard->nunits = size >> SB_SHIFT;
+#ifdef THREADS
+  for (int i = 0; i <= NHEAPS; i++)
+    pthread_mutex_init(&hoard->heaps[i].lock, NULL);
+  pthread_mutex_init(&hoard->unit_lock, NULL);
+  /* Other threads must not outlive the heap they were assigned to. */
+  thread_heap = 0;
+#endif
+  return 0;
+}
+
+/* --=[ malloc ]=----------------------------------------------------------- */
+
+static void *large_alloc(size_t size) {
+  /* Could not fit the heap, and rounding it up could wrap around. */
+  if (size > MAX_HEAP)
+    return NULL;
+  sb_t *sb = units_alloc((size + SB_HDR + SB_SIZE - 1) >> SB_SHIFT);
+  if (!sb)
+    return NULL;
+  sb->type = SB_LARGE;
+  return (void *)sb + SB_HDR;
+}
+
+void *malloc(size_t size) {
+  if (size > OBJ_MAX)
+    return large_alloc(size);
+
+  /* Sizes above any seen by gen-classes.py share a class that is too big
+   * for a superblock. */
+  int k = size_class(size ? round_up(size) : ALIGNMENT);
+  if (class_size[k] > OBJ_MAX)
+    return large_alloc(size);
+  hheap_t *h = my_heap();
+
+  heap_lock(h);
+#ifdef THREADS
+  h->stats.mallocs++;
+#endif
+  sb_t *sb = heap_find(h, k);
+  if (!sb && !(sb = heap_refill(h, k))) {
+    heap_unlock(h);
+    return NULL;
+  }
+
+  void *obj;
+  if (sb->free) {
+    obj = from_offset(sb->free);
+    sb->free = *(uint32_t *)obj;
+  } else {
+    obj = from_offset(sb->bump);
+    sb->bump += class_size[k];
+  }
+  sb->inuse++;
+  h->in_use += class_size[k];
+  bin_update(h, sb);
+  heap_unlock(h);
+
+  return obj;
+}
+
+/* --=[ free ]=------------------------------------------------------------- */
+
+void free(void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  sb_t *sb = sb_of(ptr);
+  if (sb->type == SB_LARGE) {
+    units_free(sb);
+    return;
+  }
+
+  /* The superblock may move to another heap until we hold its owner. */
+  hheap_t *h;
+  for (;;) {
+    h = &hoard->heaps[__atomic_load_n(&sb->owner, __ATOMIC_ACQUIRE)];
+    heap_lock(h);
+    if (h == &hoard->heaps[sb->owner])
+      break;
+    heap_unlock(h);
+  }
+
+#ifdef THREADS
+  if (h == my_heap())
+    h->stats.frees++;
+  else
+    h->stats.remote_frees++;
+#endif
+
+  *(uint32_t *)ptr = sb->free;
+  sb->free = to_offset(ptr);
+  sb->inuse--;
+  h->in_use -= class_size[sb->sclass];
+  bin_update(h, sb);
+
+  if (h != &hoard->heaps[0])
+    heap_release(h);
+  heap_unlock(h);
+}
+
+/* --=[ realloc ]=---------------------------------------------------------- */
+
+static inline size_t usable_size(void *ptr) {
+  sb_t *sb = sb_of(ptr);
+  if (sb->type == SB_LARGE)
+    return ((size_t)sb->nunits << SB_SHIFT) - SB_HDR;
+  return class_size[sb->sclass];
+}
+
+void *realloc(void *old_ptr, size_t size) {
+  /* If size == 0 then this is just free, and we return NULL. */
+  if (size == 0) {
+    free(old_ptr);
+    return NULL;
+  }
+
+  /* If old_ptr is NULL, then this is just malloc. */
+  if (!old_ptr)
+    return malloc(size);
+
+  size_t old_size = usable_size(old_ptr);
+  if (size <= old_size)
+    return old_ptr;
+
+  void *new_ptr = malloc(size);
+
+  /* If malloc() fails, the original block is left untouched. */
+  if (!new_ptr)
+    return NULL;
+
+  /* Copy the old data. */
+  memcpy(new_ptr, old_ptr, old_size);
+
+  /* Free the old block. */
+  free(old_ptr);
+
+  return new_ptr;
+}
+
+/* --=[ calloc ]=----------------------------------------------------------- */
+
+void *calloc(size_t nmemb, size_t size) {
+  size_t bytes = nmemb * size;
+  void *new_ptr = malloc(bytes);
+  if (new_ptr)
+    memset(new_ptr, 0, bytes);
+  return new_ptr;
+}
+
+/* --=[ stats ]=------------------------------------------------------------ */
+
+#ifdef THREADS
+/* Heap 0 is the global heap. remote_frees counts frees from threads that
+ * allocate elsewhere. */
+int mm_heap_stats(int i, mm_heap_stats_t *stats) {
+  if (i < 0 || i > NHEAPS)
+    return -1;
+  hheap_t *h = &hoard->heaps[i];
+  pthread_mutex_lock(&h->lock);
+  *stats = h->stats;
+  pthread_mutex_unlock(&h->lock);
+  return 0;
+}
+
+int mm_class_stats(int i, int k, mm_lock_stats_t *stats) {
+  return -1;
+}
+#endif
+
+/* --=[ mm_checkheap ]=----------------------------------------------------- */
+
+/* A broken heap can not be trusted with anything, so the first problem
+ * found ends the program. */
+static void check_fail(void *sb, const char *what) {
+  fprintf(stderr, "mm_checkheap: superblock at %p: %s\n", sb, what);
+  abort();
+}
+
+/* Free objects must lie inside the superblock at an object boundary below
+ * bump, and add up with inuse to all objects bumped out so far. */
+static void check_small(sb_t *sb) {
+  uint32_t start = to_offset(sb) + SB_HDR;
+  size_t size = class_size[sb->sclass];
+  if (size > OBJ_MAX || sb->capacity != (SB_SIZE - SB_HDR) / size)
+    check_fail(sb, "bad size class");
+  if (sb->bump < start || (sb->bump - start) % size ||
+      (sb->bump - start) / size > sb->capacity)
+    check_fail(sb, "bump pointer out of place");
+  if (sb->owner > NHEAPS || sb->bin != sb_bin(sb))
+    check_fail(sb, "bad owner or fullness bin");
+  uint32_t nfree = 0;
+  for (uint32_t o = sb->free; o; o = *(uint32_t *)from_offset(o)) {
+    if (o < start || o >= sb->bump || (o - start) % size)
+      check_fail(sb, "free object outside its superblock");
+    if (++nfree > sb->capacity)
+      check_fail(sb, "free object list has a cycle");
+  }
+  if (sb->inuse + nfree != (sb->bump - start) / size)
+    check_fail(sb, "objects in use do not add up");
+}
+
+/* Checks the links of a list and returns how many entries it has. */
+static size_t check_list(uint32_t head, void (*check)(sb_t *, void *),
+                         void *arg) {
+  size_t n = 0;
+  uint32_t prev = 0;
+  for (uint32_t s = head; s; s = ((sb_t *)from_offset(s))->next, n++) {
+    sb_t *sb = from_offset(s);
+    if (sb->prev != prev)
+      check_fail(sb, "list entry does not link back");
+    check(sb, arg);
+    prev = s;
+  }
+  return n;
+}
+
+static void check_free_run(sb_t *sb, void *one) {
+  if (sb->type != SB_FREE || (sb->nunits == 1) != (one != NULL))
+    check_fail(sb, "bad run on a free list");
+}
+
+static void check_binned(sb_t *sb, void *where) {
+  uint8_t *kb = where;
+  if (sb->type != SB_SMALL || sb->sclass != kb[0] || sb->bin != kb[1] ||
+      sb->owner != kb[2])
+    check_fail(sb, "superblock in the bin of another class or heap");
+}
+
+/* Walks all superblocks, then the bins of every heap and the free runs,
+ * and checks that both find the same superblocks and that the in_use and
+ * held totals of each heap are right. */
+void mm_checkheap(int verbose) {
+  size_t in_use[NHEAPS + 1] = {0}, held[NHEAPS + 1] = {0};
+  size_t nsmall = 0, nfree = 0;
+
+  for (int i = 1; i <= NHEAPS; i++)
+    heap_lock(&hoard->heaps[i]);
+  heap_lock(&hoard->heaps[0]);
+  units_lock();
+
+  size_t unit = (sizeof(hoard_t) + SB_SIZE - 1) >> SB_SHIFT;
+  while (unit < hoard->nunits) {
+    sb_t *sb = hoard_base + (unit << SB_SHIFT);
+    if (!sb->nunits || unit + sb->nunits > hoard->nunits)
+      check_fail(sb, "run does not fit the heap");
+    if (verbose)
+      printf("superblock %zu+%u type %d\n", unit, sb->nunits, sb->type);
+    switch (sb->type) {
+      case SB_SMALL:
+        if (sb->nunits != 1)
+          check_fail(sb, "small superblock longer than a unit");
+        check_small(sb);
+        in_use[sb->owner] += (size_t)sb->inuse * class_size[sb->sclass];
+        held[sb->owner] += SB_SIZE;
+        nsmall++;
+        break;
+      case SB_FREE:
+        nfree++;
+        break;
+      case SB_LARGE:
+        break;
+      default:
+        check_fail(sb, "bad superblock type");
+    }
+    unit += sb->nunits;
+  }
+
+  nfree -= check_list(hoard->free_units, check_free_run, hoard);
+  nfree -= check_list(hoard->free_runs, check_free_run, NULL);
+  if (nfree)
+    check_fail(hoard, "free runs missing from the free lists");
+  for (int i = 0; i <= NHEAPS; i++) {
+    hheap_t *h = &hoard->heaps[i];
+    if (h->in_use != in_use[i] || h->held != held[i])
+      check_fail(h, "heap totals do not match its superblocks");
+    for (int k = 0; k < NCLASSES; k++) {
+      for (int b = 0; b <= NBINS; b++) {
+        uint8_t where[3] = {k, b, i};
+        nsmall -= check_list(h->bins[k][b], check_binned, where);
+      }
+    }
+  }
+  if (nsmall)
+    check_fail(hoard, "superblocks missing from the bins");
+
+  units_unlock();
+  heap_unlock(&hoard->heaps[0]);
+  for (int i = NHEAPS; i >= 1; i--)
+    heap_unlock(&hoard->heaps[i]);
+}
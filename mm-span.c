@@ -0,0 +1,950 @@
+/*Jakub Chomiczewski 329713*/
+
+/*
+ * Page heap variant.
+ *
+ * The heap is managed in PAGE_SIZE pages. A run of contiguous pages is a
+ * span and has a descriptor (span_t) kept in metadata pages. A two-level
+ * radix map turns a page number into its span, so any pointer finds its
+ * metadata in two loads and blocks carry no boundary tags.
+ *
+ * Requests up to SLAB_MAX bytes come from slabs: spans cut into objects of
+ * a single size class from mm-classes.h. Bigger requests get whole pages.
+ * Like in mimalloc every slab has three lists of free objects: malloc pops
+ * from free, free pushes to local_free and frees from other threads go to
+ * thread_free. The latter two are moved to free only once it runs dry, so
+ * the fast paths touch nothing but the slab itself.
+ * Both take spans from the same page allocator, which merges a freed span
+ * with free neighbours found through the radix map.
+ *
+ * With THREADS every thread has slab lists of its own and owns the slabs
+ * on them, so only the page allocator, the radix map and the metadata are
+ * shared. A single lock guards them. Slab lists of an exited thread are
+ * adopted by the next new thread, together with their slabs.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mm-classes.h"
+
+#ifdef THREADS
+#include <pthread.h>
+#include <time.h>
+#endif
+
+/* If you want debugging output, use the following macro.
+ * When you hand in, remove the #define DEBUG line. */
+// #define DEBUG
+#ifdef DEBUG
+#define debug(fmt, ...) printf("%s: " fmt "\n", __func__, __VA_ARGS__)
+#define msg(...) printf(__VA_ARGS__)
+#else
+#define debug(fmt, ...)
+#define msg(...)
+#endif
+
+#define __unused __attribute__((unused))
+
+/* do not change the following! */
+#ifdef DRIVER
+/* create aliases for driver tests */
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#endif /* !DRIVER */
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define MAX_PAGES (MAX_HEAP >> PAGE_SHIFT)
+/* Anything bigger can not fit the heap, and rounding it to pages could
+ * wrap around. */
+#define LARGE_MAX ((size_t)MAX_PAGES << PAGE_SHIFT)
+
+/* Radix map: root indexed by the high bits of a page number, leaves by the
+ * low LEAF_BITS. Leaves are allocated when first needed. */
+#define LEAF_BITS 8
+#define LEAF_SIZE (1 << LEAF_BITS)
+#define ROOT_SIZE ((MAX_PAGES + LEAF_SIZE - 1) >> LEAF_BITS)
+
+/* Free spans of 1..NSPANLISTS-1 pages have exact lists, longer ones share
+ * the last list. */
+#define NSPANLISTS 128
+
+/* Biggest request served from a slab. */
+#define SLAB_MAX 8192
+/* Slabs grow until they waste at most 1/SLAB_WASTE of their pages. */
+#define SLAB_WASTE 8
+#define SLAB_MAX_PAGES 16
+
+typedef enum {
+  SPAN_FREE = 0,  /* on a free span list */
+  SPAN_LARGE = 1, /* single big request */
+  SPAN_SLAB = 2,  /* objects of one size class */
+  SPAN_META = 3,  /* descriptors and radix leaves */
+} span_state;
+
+/* All links are offsets from heap_base, offset 0 is the heap header so it
+ * doubles as NULL. */
+typedef struct {
+  uint32_t page;   /* first page */
+  uint32_t npages; /* length in pages */
+  uint32_t prev;   /* free span list or class partial list */
+  uint32_t next;
+  uint32_t free;        /* slab: objects malloc takes from */
+  uint32_t local_free;  /* slab: objects freed by the owner */
+#ifdef THREADS
+  uint32_t thread_free; /* slab: objects freed by other threads, atomic */
+  uint32_t owner;       /* slab: slab lists it is on */
+#endif
+  uint32_t bump;        /* slab: first object never handed out */
+  uint16_t inuse;       /* slab: objects not on free or local_free */
+  uint8_t state;        /* span_state */
+  uint8_t sclass;       /* slab: size class */
+  bool full;            /* slab: on the full list instead of partial */
+} span_t;
+
+/* Slab lists of one thread, only the owner touches them. */
+typedef struct {
+  uint32_t partial[NCLASSES]; /* slabs with room, per class */
+  uint32_t full[NCLASSES];    /* slabs found exhausted */
+#ifdef THREADS
+  uint32_t next;              /* every slab lists but the first */
+  bool orphan;                /* its thread has exited */
+#endif
+} slabs_t;
+
+/* Heap header, lives at the start of page 0. */
+typedef struct {
+  uint32_t root[ROOT_SIZE];         /* radix map leaves */
+  uint32_t free_spans[NSPANLISTS];  /* free spans by length */
+  uint64_t nonempty[NSPANLISTS / 64];
+  uint32_t span_pool;               /* unused descriptors */
+  uint32_t meta_cur;                /* bump area for metadata */
+  uint32_t meta_end;
+  uint32_t npages;                  /* pages between heap_base and brk */
+  span_t meta_span;                 /* stands for every metadata page */
+  slabs_t slabs;                    /* of the thread that called mm_init */
+#ifdef THREADS
+  pthread_mutex_t lock;             /* pages, radix map and metadata */
+  mm_heap_stats_t stats;
+#endif
+} heap_t;
+
+static void *heap_base = NULL;
+static heap_t *heap = NULL;
+
+#ifdef THREADS
+static __thread slabs_t *thread_slabs; /* NULL until the thread's first malloc */
+static pthread_key_t slabs_key;        /* orphans the lists of an exited thread */
+static pthread_once_t slabs_once = PTHREAD_ONCE_INIT;
+#endif
+
+#define round_up(size) ((size + ALIGNMENT - 1) & -ALIGNMENT)
+
+/* --=[ offsets and radix map ]=-------------------------------------------- */
+
+static inline void *from_offset(uint32_t offset) {
+  return heap_base + offset;
+}
+
+static inline uint32_t to_offset(void *ptr) {
+  return ptr - heap_base;
+}
+
+static inline void *page_addr(uint32_t page) {
+  return heap_base + ((size_t)page << PAGE_SHIFT);
+}
+
+static inline uint32_t page_of(void *ptr) {
+  return (ptr - heap_base) >> PAGE_SHIFT;
+}
+
+static void *meta_alloc(size_t size);
+
+static inline span_t *span_of_page(uint32_t page) {
+  uint32_t leaf = heap->root[page >> LEAF_BITS];
+  if (!leaf)
+    return NULL;
+  uint32_t span = ((uint32_t *)from_offset(leaf))[page & (LEAF_SIZE - 1)];
+  return span ? from_offset(span) : NULL;
+}
+
+static inline span_t *span_of(void *ptr) {
+  return span_of_page(page_of(ptr));
+}
+
+static void map_page(uint32_t page, span_t *span) {
+  uint32_t *leaf_p = &heap->root[page >> LEAF_BITS];
+  if (!*leaf_p) {
+    uint32_t *leaf = meta_alloc(LEAF_SIZE * sizeof(uint32_t));
+    /* The metadata page meta_alloc() took may have needed this very leaf,
+     * which is then in place already. */
+    if (!*leaf_p) {
+      memset(leaf, 0, LEAF_SIZE * sizeof(uint32_t));
+      *leaf_p = to_offset(leaf);
+    }
+  }
+  ((uint32_t *)from_offset(*leaf_p))[page & (LEAF_SIZE - 1)] =
+    to_offset(span);
+}
+
+/* Free and large spans are only ever looked up by their edge pages. */
+static inline void map_edges(span_t *span) {
+  map_page(span->page, span);
+  if (span->npages > 1)
+    map_page(span->page + span->npages - 1, span);
+}
+
+static inline void map_all(span_t *span) {
+  for (uint32_t i = 0; i < span->npages; i++)
+    map_page(span->page + i, span);
+}
+
+/* --=[ locking ]=---------------------------------------------------------- */
+
+/* Everything below slabs, from more_pages() up to the page allocator and
+ * the radix map updates, runs with the page lock held. */
+#ifdef THREADS
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline void page_lock(void) {
+  if (pthread_mutex_trylock(&heap->lock)) {
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&heap->lock);
+    heap->stats.wait_ns += now_ns() - start;
+    heap->stats.contended++;
+  }
+  heap->stats.locks++;
+}
+
+static inline void page_unlock(void) {
+  pthread_mutex_unlock(&heap->lock);
+}
+#else
+static inline void page_lock(void) {
+}
+
+static inline void page_unlock(void) {
+}
+#endif
+
+/* --=[ metadata ]=--------------------------------------------------------- */
+
+/* Grows the heap by whole pages. */
+static void *more_pages(size_t npages) {
+  if (heap->npages + npages > MAX_PAGES)
+    return NULL;
+  void *ptr = mem_sbrk(npages << PAGE_SHIFT);
+  if ((long)ptr < 0)
+    return NULL;
+  heap->npages += npages;
+  return ptr;
+}
+
+/* Bump allocator for descriptors and radix leaves. Takes fresh pages
+ * straight from the top of the heap, so it never recurses into the page
+ * allocator. */
+static void *meta_alloc(size_t size) {
+  if (heap->meta_cur + size > heap->meta_end) {
+    void *page = more_pages(1);
+    if (!page)
+      return NULL;
+    heap->meta_cur = to_offset(page);
+    heap->meta_end = heap->meta_cur + PAGE_SIZE;
+    map_page(page_of(page), &heap->meta_span);
+  }
+  void *ptr = from_offset(heap->meta_cur);
+  heap->meta_cur += size;
+  return ptr;
+}
+
+static span_t *span_new(uint32_t page, uint32_t npages) {
+  span_t *span;
+  if (heap->span_pool) {
+    span = from_offset(heap->span_pool);
+    heap->span_pool = span->next;
+  } else if (!(span = meta_alloc(sizeof(span_t)))) {
+    return NULL;
+  }
+  memset(span, 0, sizeof(span_t));
+  span->page = page;
+  span->npages = npages;
+  return span;
+}
+
+static inline void span_delete(span_t *span) {
+  span->next = heap->span_pool;
+  heap->span_pool = to_offset(span);
+}
+
+/* --=[ span lists ]=------------------------------------------------------- */
+
+static inline void list_push(uint32_t *head, span_t *span) {
+  span->prev = 0;
+  span->next = *head;
+  if (*head)
+    ((span_t *)from_offset(*head))->prev = to_offset(span);
+  *head = to_offset(span);
+}
+
+static inline void list_remove(uint32_t *head, span_t *span) {
+  if (span->prev)
+    ((span_t *)from_offset(span->prev))->next = span->next;
+  else
+    *head = span->next;
+  if (span->next)
+    ((span_t *)from_offset(span->next))->prev = span->prev;
+}
+
+static inline int span_list(uint32_t npages) {
+  return npages < NSPANLISTS ? npages : NSPANLISTS - 1;
+}
+
+static void free_push(span_t *span) {
+  int k = span_list(span->npages);
+  span->state = SPAN_FREE;
+  list_push(&heap->free_spans[k], span);
+  heap->nonempty[k >> 6] |= 1UL << (k & 63);
+  map_edges(span);
+}
+
+static void free_remove(span_t *span) {
+  int k = span_list(span->npages);
+  list_remove(&heap->free_spans[k], span);
+  if (!heap->free_spans[k])
+    heap->nonempty[k >> 6] &= ~(1UL << (k & 63));
+}
+
+/* --=[ page allocator ]=--------------------------------------------------- */
+
+/* First free span from the lists at or above k that has npages pages. */
+static span_t *find_span(uint32_t npages) {
+  int k = span_list(npages);
+
+  for (int w = k >> 6; w < NSPANLISTS / 64; w++) {
+    uint64_t mask = heap->nonempty[w];
+    if (w == k >> 6)
+      mask &= ~0UL << (k & 63);
+    while (mask) {
+      int l = (w << 6) + __builtin_ctzl(mask);
+      if (l < NSPANLISTS - 1)
+        return from_offset(heap->free_spans[l]);
+      /* Long spans: best fit. */
+      span_t *fit = NULL;
+      for (uint32_t s = heap->free_spans[l]; s;) {
+        span_t *span = from_offset(s);
+        if (span->npages >= npages && (!fit || span->npages < fit->npages))
+          fit = span;
+        s = span->next;
+      }
+      if (fit)
+        return fit;
+      mask &= mask - 1;
+    }
+  }
+  return NULL;
+}
+
+/* Returns a span of exactly npages pages, not entered in the radix map. */
+static span_t *page_alloc(uint32_t npages) {
+  span_t *span = find_span(npages);
+
+  if (span) {
+    free_remove(span);
+    if (span->npages > npages) {
+      span_t *rest =
+        span_new(span->page + npages, span->npages - npages);
+      if (!rest) {
+        free_push(span);
+        return NULL;
+      }
+      span->npages = npages;
+      free_push(rest);
+    }
+    return span;
+  }
+
+  /* Nothing fits: grow the heap, reusing a free span at its very end. */
+  span_t *last = heap->npages ? span_of_page(heap->npages - 1) : NULL;
+  if (last && last->state == SPAN_FREE) {
+    if (!more_pages(npages - last->npages))
+      return NULL;
+    free_remove(last);
+    last->npages = npages;
+    return last;
+  }
+
+  void *ptr = more_pages(npages);
+  if (!ptr)
+    return NULL;
+  if (!(span = span_new(page_of(ptr), npages)))
+    return NULL;
+  return span;
+}
+
+/* Gives pages back, merging with free neighbours. */
+static void page_free(span_t *span) {
+  span_t *left = span->page ? span_of_page(span->page - 1) : NULL;
+  if (left && left->state == SPAN_FREE) {
+    free_remove(left);
+    span->page = left->page;
+    span->npages += left->npages;
+    span_delete(left);
+  }
+
+  uint32_t end = span->page + span->npages;
+  span_t *right = end < heap->npages ? span_of_page(end) : NULL;
+  if (right && right->state == SPAN_FREE) {
+    free_remove(right);
+    span->npages += right->npages;
+    span_delete(right);
+  }
+
+  free_push(span);
+}
+
+/* --=[ slabs ]=------------------------------------------------------------ */
+
+static uint32_t slab_pages(size_t objsize) {
+  uint32_t npages = 1;
+  while (npages < SLAB_MAX_PAGES) {
+    size_t bytes = (size_t)npages << PAGE_SHIFT;
+    if (bytes >= objsize && (bytes % objsize) * SLAB_WASTE <= bytes)
+      break;
+    npages++;
+  }
+  return npages;
+}
+
+#ifdef THREADS
+static void slabs_orphan(void *slabs) {
+  page_lock();
+  ((slabs_t *)slabs)->orphan = true;
+  page_unlock();
+}
+
+static void slabs_key_create(void) {
+  if (pthread_key_create(&slabs_key, slabs_orphan))
+    abort();
+}
+
+/* Slab lists for a new thread: those of an exited thread if there are
+ * any, so its slabs are used again, or fresh ones. */
+static slabs_t *slabs_adopt(void) {
+  slabs_t *slabs = NULL;
+  page_lock();
+  for (uint32_t s = heap->slabs.next; s && !slabs;) {
+    slabs_t *lists = from_offset(s);
+    if (lists->orphan)
+      slabs = lists;
+    s = lists->next;
+  }
+  if (slabs) {
+    slabs->orphan = false;
+  } else if ((slabs = meta_alloc(sizeof(slabs_t)))) {
+    memset(slabs, 0, sizeof(slabs_t));
+    slabs->next = heap->slabs.next;
+    heap->slabs.next = to_offset(slabs);
+  }
+  if (slabs)
+    heap->stats.threads++;
+  page_unlock();
+  if (slabs)
+    pthread_setspecific(slabs_key, slabs);
+  return slabs;
+}
+
+static inline slabs_t *my_slabs(void) {
+  if (!thread_slabs)
+    thread_slabs = slabs_adopt();
+  return thread_slabs;
+}
+#else
+static inline slabs_t *my_slabs(void) {
+  return &heap->slabs;
+}
+#endif
+
+static span_t *slab_new(slabs_t *slabs, int k) {
+  page_lock();
+  span_t *span = page_alloc(slab_pages(class_size[k]));
+  if (span) {
+    span->state = SPAN_SLAB;
+    map_all(span);
+  }
+  page_unlock();
+  if (!span)
+    return NULL;
+  span->sclass = k;
+  span->free = 0;
+  span->local_free = 0;
+#ifdef THREADS
+  span->thread_free = 0;
+  span->owner = to_offset(slabs);
+#endif
+  span->bump = to_offset(page_addr(span->page));
+  span->inuse = 0;
+  span->full = false;
+  list_push(&slabs->partial[k], span);
+  return span;
+}
+
+/* Refills the free list from local_free and thread_free, and failing that
+ * from the part of the slab never handed out. */
+static bool slab_collect(span_t *span) {
+  /* Slabs behind the first one of their class may still have some. */
+  if (span->free)
+    return true;
+
+#ifdef THREADS
+  uint32_t remote =
+    __atomic_exchange_n(&span->thread_free, 0, __ATOMIC_ACQUIRE);
+  if (remote) {
+    uint32_t *last = from_offset(remote);
+    span->inuse--;
+    while (*last) {
+      last = from_offset(*last);
+      span->inuse--;
+    }
+    *last = span->local_free;
+    span->local_free = remote;
+  }
+#endif
+
+  span->free = span->local_free;
+  span->local_free = 0;
+  if (span->free)
+    return true;
+
+  uint32_t end = to_offset(page_addr(span->page + span->npages));
+  size_t size = class_size[span->sclass];
+  if (span->bump + size > end)
+    return false;
+  /* Hand out one object at a time, so a slab touches no more of its pages
+   * than it has to. */
+  span->free = span->bump;
+  *(uint32_t *)from_offset(span->bump) = 0;
+  span->bump += size;
+  return true;
+}
+
+/* Finds a slab with a free object, parking exhausted ones on the full
+ * list. */
+static span_t *slab_refill(slabs_t *slabs, int k) {
+  for (uint32_t s = slabs->partial[k]; s;) {
+    span_t *span = from_offset(s);
+    if (slab_collect(span))
+      return span;
+    s = span->next;
+    list_remove(&slabs->partial[k], span);
+    list_push(&slabs->full[k], span);
+    span->full = true;
+  }
+
+#ifdef THREADS
+  /* Full slabs only get objects back from other threads. */
+  for (uint32_t s = slabs->full[k]; s; s = ((span_t *)from_offset(s))->next) {
+    span_t *span = from_offset(s);
+    if (span->thread_free && slab_collect(span)) {
+      list_remove(&slabs->full[k], span);
+      list_push(&slabs->partial[k], span);
+      span->full = false;
+      return span;
+    }
+  }
+#endif
+
+  span_t *span = slab_new(slabs, k);
+  if (span && !slab_collect(span))
+    return NULL;
+  return span;
+}
+
+static void *slab_alloc(int k) {
+  slabs_t *slabs = my_slabs();
+#ifdef THREADS
+  if (!slabs)
+    return NULL;
+#endif
+  span_t *span = slabs->partial[k] ? from_offset(slabs->partial[k]) : NULL;
+
+  if (!span || !span->free)
+    if (!(span = slab_refill(slabs, k)))
+      return NULL;
+
+  uint32_t *obj = from_offset(span->free);
+  span->free = *obj;
+  span->inuse++;
+  return obj;
+}
+
+#ifdef THREADS
+static void slab_free_remote(span_t *span, void *obj) {
+  uint32_t head = __atomic_load_n(&span->thread_free, __ATOMIC_RELAXED);
+  do {
+    *(uint32_t *)obj = head;
+  } while (!__atomic_compare_exchange_n(&span->thread_free, &head,
+                                        to_offset(obj), true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+#endif
+
+static void slab_free(span_t *span, void *obj) {
+#ifdef THREADS
+  if (!thread_slabs || span->owner != to_offset(thread_slabs)) {
+    slab_free_remote(span, obj);
+    return;
+  }
+#endif
+  slabs_t *slabs = my_slabs();
+
+  *(uint32_t *)obj = span->local_free;
+  span->local_free = to_offset(obj);
+  span->inuse--;
+
+  int k = span->sclass;
+  if (span->full) {
+    list_remove(&slabs->full[k], span);
+    list_push(&slabs->partial[k], span);
+    span->full = false;
+  }
+
+  /* Keep the last slab of a class around, so that a single object being
+   * allocated and freed in a loop does not thrash the page allocator.
+   * Objects on thread_free count as in use, so none can be left. */
+  if (!span->inuse && (span->prev || span->next)) {
+    list_remove(&slabs->partial[k], span);
+    page_lock();
+    page_free(span);
+    page_unlock();
+  }
+}
+
+/* --=[ mm_init ]=---------------------------------------------------------- */
+
+int mm_init(void) {
+  size_t pad = -(size_t)mem_sbrk(0) & (PAGE_SIZE - 1);
+  if ((long)mem_sbrk(pad) < 0)
+    return -1;
+
+  heap_base = mem_sbrk(PAGE_SIZE);
+  if ((long)heap_base < 0)
+    return -1;
+
+  heap = heap_base;
+  memset(heap, 0, sizeof(heap_t));
+  heap->npages = 1;
+  heap->meta_span.state = SPAN_META;
+  heap->meta_cur = round_up(sizeof(heap_t));
+  heap->meta_end = PAGE_SIZE;
+  map_page(0, &heap->meta_span);
+#ifdef THREADS
+  pthread_once(&slabs_once, slabs_key_create);
+  pthread_mutex_init(&heap->lock, NULL);
+  /* Other threads must not outlive the heap their lists are in. */
+  thread_slabs = &heap->slabs;
+  pthread_setspecific(slabs_key, NULL);
+#endif
+  return 0;
+}
+
+/* --=[ malloc ]=----------------------------------------------------------- */
+
+static void *large_alloc(size_t size) {
+  if (size > LARGE_MAX)
+    return NULL;
+  page_lock();
+  span_t *span = page_alloc((size + PAGE_SIZE - 1) >> PAGE_SHIFT);
+  if (span) {
+    span->state = SPAN_LARGE;
+    map_edges(span);
+  }
+  page_unlock();
+  return span ? page_addr(span->page) : NULL;
+}
+
+void *malloc(size_t size) {
+  if (size <= SLAB_MAX) {
+    int k = size_class(size ? round_up(size) : ALIGNMENT);
+    /* Sizes above any seen by gen-classes.py share a class that is too
+     * big for a slab. */
+    if (class_size[k] <= SLAB_MAX)
+      return slab_alloc(k);
+  }
+  return large_alloc(size);
+}
+
+/* --=[ free ]=------------------------------------------------------------- */
+
+void free(void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  span_t *span = span_of(ptr);
+  if (span->state == SPAN_SLAB) {
+    slab_free(span, ptr);
+  } else {
+    page_lock();
+    page_free(span);
+    page_unlock();
+  }
+}
+
+/* --=[ realloc ]=---------------------------------------------------------- */
+
+static inline size_t usable_size(span_t *span) {
+  if (span->state == SPAN_SLAB)
+    return class_size[span->sclass];
+  return (size_t)span->npages << PAGE_SHIFT;
+}
+
+/* Grows a large span in place by taking pages from the free span right
+ * after it, or from the top of the heap. */
+static bool large_expand(span_t *span, uint32_t npages) {
+  uint32_t end = span->page + span->npages;
+  uint32_t need = npages - span->npages;
+
+  if (end == heap->npages) {
+    if (!more_pages(need))
+      return false;
+  } else {
+    span_t *right = span_of_page(end);
+    if (right->state != SPAN_FREE || right->npages < need)
+      return false;
+    free_remove(right);
+    if (right->npages > need) {
+      right->page += need;
+      right->npages -= need;
+      free_push(right);
+    } else {
+      span_delete(right);
+    }
+  }
+
+  span->npages = npages;
+  map_edges(span);
+  return true;
+}
+
+void *realloc(void *old_ptr, size_t size) {
+  /* If size == 0 then this is just free, and we return NULL. */
+  if (size == 0) {
+    free(old_ptr);
+    return NULL;
+  }
+
+  /* If old_ptr is NULL, then this is just malloc. */
+  if (!old_ptr)
+    return malloc(size);
+
+  span_t *span = span_of(old_ptr);
+  size_t old_size = usable_size(span);
+  if (size <= old_size)
+    return old_ptr;
+  if (size > LARGE_MAX)
+    return NULL;
+
+  if (span->state == SPAN_LARGE) {
+    page_lock();
+    bool expanded = large_expand(span, (size + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    page_unlock();
+    if (expanded)
+      return old_ptr;
+  }
+
+  void *new_ptr = malloc(size);
+
+  /* If malloc() fails, the original block is left untouched. */
+  if (!new_ptr)
+    return NULL;
+
+  /* Copy the old data. */
+  memcpy(new_ptr, old_ptr, old_size);
+
+  /* Free the old block. */
+  free(old_ptr);
+
+  return new_ptr;
+}
+
+/* --=[ calloc ]=----------------------------------------------------------- */
+
+void *calloc(size_t nmemb, size_t size) {
+  size_t bytes = nmemb * size;
+  void *new_ptr = malloc(bytes);
+  if (new_ptr)
+    memset(new_ptr, 0, bytes);
+  return new_ptr;
+}
+
+/* --=[ stats ]=------------------------------------------------------------ */
+
+#ifdef THREADS
+/* The page lock is the only heap there is. threads counts the slab lists
+ * handed out to threads. */
+int mm_heap_stats(int i, mm_heap_stats_t *stats) {
+  if (i != 0)
+    return -1;
+  page_lock();
+  *stats = heap->stats;
+  page_unlock();
+  return 0;
+}
+
+int mm_class_stats(int i, int k, mm_lock_stats_t *stats) {
+  return -1;
+}
+#endif
+
+/* --=[ mm_checkheap ]=----------------------------------------------------- */
+
+/* A broken heap can not be trusted with anything, so the first problem
+ * found ends the program. */
+static void check_fail(span_t *span, const char *what) {
+  fprintf(stderr, "mm_checkheap: span at page %u: %s\n",
+          span ? span->page : 0, what);
+  abort();
+}
+
+/* Counts the objects on a slab list, which must all lie in the slab at an
+ * object boundary below bump. */
+static uint32_t check_objects(span_t *span, uint32_t list) {
+  uint32_t start = to_offset(page_addr(span->page));
+  size_t size = class_size[span->sclass];
+  uint32_t n = 0;
+  for (; list; list = *(uint32_t *)from_offset(list), n++) {
+    if (list < start || list >= span->bump || (list - start) % size)
+      check_fail(span, "free object outside its slab");
+    if (n > span->bump - start)
+      check_fail(span, "free object list has a cycle");
+  }
+  return n;
+}
+
+static void check_slab(span_t *span) {
+  for (uint32_t i = 0; i < span->npages; i++)
+    if (span_of_page(span->page + i) != span)
+      check_fail(span, "slab page not mapped to its slab");
+  if (class_size[span->sclass] > SLAB_MAX)
+    check_fail(span, "slab of a class too big for slabs");
+  uint32_t start = to_offset(page_addr(span->page));
+  uint32_t end = to_offset(page_addr(span->page + span->npages));
+  size_t size = class_size[span->sclass];
+  if (span->bump < start || span->bump > end || (span->bump - start) % size)
+    check_fail(span, "slab bump pointer out of place");
+  uint32_t nfree = check_objects(span, span->free) +
+                   check_objects(span, span->local_free);
+#ifdef THREADS
+  /* Objects freed by other threads count as in use until collected. */
+  check_objects(span, span->thread_free);
+#endif
+  if (span->inuse + nfree != (span->bump - start) / size)
+    check_fail(span, "slab objects in use do not add up");
+}
+
+/* Checks the spans on a list and returns how many there are. */
+static uint32_t check_list(uint32_t head, span_state state, int k,
+                           bool full, slabs_t *slabs) {
+  uint32_t n = 0;
+  uint32_t prev = 0;
+  for (uint32_t s = head; s; s = ((span_t *)from_offset(s))->next, n++) {
+    span_t *span = from_offset(s);
+    if (span->prev != prev)
+      check_fail(span, "span does not link back");
+    if (span->state != state)
+      check_fail(span, "span on the list of another state");
+    if (state == SPAN_FREE && span_list(span->npages) != k)
+      check_fail(span, "free span on the list of another length");
+    if (state == SPAN_SLAB && (span->sclass != k || span->full != full))
+      check_fail(span, "slab on the list of another class");
+#ifdef THREADS
+    if (state == SPAN_SLAB && span->owner != to_offset(slabs))
+      check_fail(span, "slab on the lists of another owner");
+#endif
+    prev = s;
+  }
+  return n;
+}
+
+/* Walks the heap span by span, then the span and slab lists, and checks
+ * that both find the same free spans and slabs. With verbose every span is
+ * printed. With THREADS no other thread may be allocating meanwhile, as
+ * their slab lists are not locked. */
+void mm_checkheap(int verbose) {
+  uint32_t nfree = 0, nslabs = 0;
+  bool was_free = false;
+
+  page_lock();
+  for (uint32_t page = 0; page < heap->npages;) {
+    span_t *span = span_of_page(page);
+    if (!span)
+      check_fail(NULL, "page not in the radix map");
+    if (span == &heap->meta_span) {
+      page++;
+      was_free = false;
+      continue;
+    }
+    if (verbose)
+      printf("span %u+%u state %d\n", span->page, span->npages,
+             span->state);
+    if (span->page != page || !span->npages ||
+        page + span->npages > heap->npages)
+      check_fail(span, "span does not cover its pages");
+    if (span_of_page(page + span->npages - 1) != span)
+      check_fail(span, "last page not mapped to its span");
+    switch (span->state) {
+      case SPAN_FREE:
+        if (was_free)
+          check_fail(span, "free span next to a free span");
+        nfree++;
+        break;
+      case SPAN_SLAB:
+        check_slab(span);
+        nslabs++;
+        break;
+      case SPAN_LARGE:
+        break;
+      default:
+        check_fail(span, "bad span state");
+    }
+    was_free = span->state == SPAN_FREE;
+    page += span->npages;
+  }
+
+  for (int k = 0; k < NSPANLISTS; k++) {
+    if (!heap->free_spans[k] != !(heap->nonempty[k >> 6] & 1UL << (k & 63)))
+      check_fail(NULL, "nonempty bit does not match the span list");
+    nfree -= check_list(heap->free_spans[k], SPAN_FREE, k, false, NULL);
+  }
+  for (slabs_t *slabs = &heap->slabs; slabs;) {
+    for (int k = 0; k < NCLASSES; k++) {
+      nslabs -= check_list(slabs->partial[k], SPAN_SLAB, k, false, slabs);
+      nslabs -= check_list(slabs->full[k], SPAN_SLAB, k, true, slabs);
+    }
+#ifdef THREADS
+    slabs = slabs->next ? from_offset(slabs->next) : NULL;
+#else
+    slabs = NULL;
+#endif
+  }
+  if (nfree)
+    check_fail(NULL, "free spans and span lists do not match");
+  if (nslabs)
+    check_fail(NULL, "slabs and slab lists do not match");
+  page_unlock();
+}
@@ -1,6 +1,13 @@
 /*Jakub Chomiczewski 329713*/
 
+/* sched_getcpu() of the HEAP_BY_CPU build is a GNU extension, and has to
+ * be asked for before any system header is included. */
+#if defined(THREADS) && defined(HEAP_BY_CPU)
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +19,7 @@
 
 #include "mm.h"
 #include "memlib.h"
+#include "mm-classes.h"
 
 /* If you want debugging output, use the following macro.
  * When you hand in, remove the #define DEBUG line. */
@@ -26,6 +34,105 @@
 
 #define __unused __attribute__((unused))
 
+/* Keep a copy of the size of a free block right after its list links, so
+ * walking a free list reads one aligned 8-byte word per block and never
+ * touches the line holding the header. */
+// #define FIT_NODE_SIZE
+
+/* Keep sizes and offsets of free blocks from the range classes in a dense
+ * side array and best-fit search it with SIMD instead of walking lists.
+ * Build with -mavx2 (or -msse4.1) to get the vector scan. */
+// #define SIDE_INDEX
+
+/* Place payloads of up to CACHE_LINE bytes so that they do not cross a
+ * cache line. Costs some padding between blocks and a slower search. */
+// #define CACHELINE_FIT
+#define CACHE_LINE 64
+
+/* Predict from the size class whether a block dies young and bump such
+ * blocks out of chunks that go back to the heap as a whole, see the
+ * lifetimes section. mm_malloc_hint() works without it, but ignores hints. */
+// #define LIFETIME
+
+/* Count mallocs, fit probes, merges and heap growth in every heap, see the
+ * statistics section. Without it the counting compiles away. */
+// #define STATS
+
+/* Remember blocks changed since the last mm_checkheap(), so that it only
+ * rechecks those. Without it every call walks the whole heap. Also makes
+ * mm_free_sized() check the size it is given. */
+// #define CHECKHEAP
+#define DIRTY_MAX 32
+
+/* Record every call into a ring of the calling thread, to be dumped with
+ * mm_events_dump(), see the events section. */
+// #define EVENTS
+
+#if defined(SIDE_INDEX) && defined(FIT_NODE_SIZE)
+#error "SIDE_INDEX and FIT_NODE_SIZE both use the word after ptr_next"
+#endif
+
+#if defined(SIDE_INDEX) && defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+/* Thread-safe build, see the locking section. Enabled by make THREADS=1. */
+#ifdef THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#define THREAD_LOCAL __thread
+#ifdef CPU_CACHE
+#include <sys/rseq.h>
+#include <sys/sysinfo.h>
+#endif
+#else
+#define THREAD_LOCAL
+#endif
+
+#ifdef EVENTS
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+#endif
+
+/* Number of heaps, each in its own memlib region with its own free lists
+ * and lock. Threads are spread over them round robin, or by the CPU they
+ * first run on with HEAP_BY_CPU. */
+#ifndef NHEAPS
+#ifdef THREADS
+#define NHEAPS 4
+#else
+#define NHEAPS 1
+#endif
+#endif
+
+/* Blocks of LARGE_MIN bytes and more go to a heap of their own, in another
+ * memlib region, so long-lived big blocks do not pin free space between
+ * small ones. Each heap gets such a partner when it first needs one. */
+// #define LARGE_HEAPS
+#ifndef LARGE_MIN
+#define LARGE_MIN 4096
+#endif
+
+#ifdef LARGE_HEAPS
+#define NREGIONS (2 * NHEAPS)
+#else
+#define NREGIONS NHEAPS
+#endif
+
+/* The handle table grows in the region after the heaps. */
+#define HANDLE_REGION NREGIONS
+
+#if NREGIONS + 1 > MAX_REGIONS
+#error "every heap and the handle table need a memlib region"
+#endif
+
+#if defined(CLASS_LOCKS) && !defined(THREADS)
+#error "CLASS_LOCKS needs the thread-safe build"
+#endif
+
 /* do not change the following! */
 #ifdef DRIVER
 /* create aliases for driver tests */
@@ -33,6 +140,9 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
 #endif /* !DRIVER */
 
 typedef int32_t word_t; /* Heap is bascially an array of 4-byte words. */
@@ -44,10 +154,77 @@ typedef struct {
   int32_t footer;
 } block_t;
 
+#ifdef CLASS_LOCKS
+/* Free blocks of one size class kept out of the coalescing heap. Classes up
+ * to TREIBER_MAX are lock-free stacks, top holding an offset and a tag in
+ * the high half against ABA. The others are lists under a spinlock. */
+typedef struct {
+  uint64_t top;
+  uint32_t count;
+  uint32_t lock;
+  uint64_t hold_start;
+  mm_lock_stats_t stats;
+} front_t;
+#endif
+
+/* Heap header stored in the payload of the prologue block. There is one free
+ * list per size class from mm-classes.h and one bit per list in nonempty.
+ * Free lists keep offsets from heap_listp, so offset 0 (the prologue) marks
+ * end of a list. */
+typedef struct heap {
+  uint64_t nonempty;            /* bit k is set iff free_list[k] != 0 */
+  uint32_t free_list[NCLASSES]; /* first free block of each size class */
+  size_t high;                  /* address past the last block */
+  size_t chunksize;             /* how much increase() asked for last */
+  int id;                       /* memlib region of this heap */
+  uint32_t compact;             /* offset mm_compact() goes on from */
+  uint32_t hfree;               /* heap 0 only: first free handle + 1 */
+#ifdef STATS
+  mm_counters_t counters;       /* updated under the lock */
+#endif
+#ifdef CHECKHEAP
+  uint32_t dirty[DIRTY_MAX]; /* blocks changed since the last check... */
+  uint32_t ndirty;           /* ... above DIRTY_MAX if they did not fit */
+#endif
+#ifdef LARGE_HEAPS
+  struct heap *small;           /* heap for blocks below LARGE_MIN... */
+  struct heap *large;           /* ... and the rest, NULL until needed */
+#endif
+#ifdef LIFETIME
+  uint32_t bump;          /* chunk short-lived blocks come from, 0 if none */
+  uint32_t bump_cur;      /* where the next one starts in it */
+  uint32_t clock;         /* mallocs so far, lifetimes are measured in them */
+  int8_t score[NCLASSES]; /* above 0 for classes that tend to die young */
+#endif
+#ifdef SIDE_INDEX
+  uint32_t idx_array; /* block with idx_cap sizes followed by idx_cap offsets */
+  uint32_t idx_cap;   /* 0 while there is no array */
+  uint32_t idx_count; /* entries in use */
+  uint8_t idx_valid;  /* array mirrors the free lists */
+  uint8_t idx_busy;   /* idx_reserve() is replacing the array */
+#endif
+#ifdef THREADS
+  pthread_mutex_t lock;
+  uint32_t remote;          /* blocks freed without taking the lock */
+  uint32_t nthreads;        /* threads using this heap for malloc */
+  mm_heap_stats_t stats;    /* updated under the lock, but remote_frees */
+  pthread_mutex_t add_lock; /* heap 0 only: serializes heap_add() */
+  uint32_t next;            /* heap 0 only: round robin position */
+#ifdef CPU_CACHE
+  void *cache;              /* heap 0 only: per-CPU cache, NULL without rseq */
+#endif
+#ifdef CLASS_LOCKS
+  front_t front[NCLASSES];
+#endif
+#endif
+} heap_t;
+
 typedef enum {
   FREE = 0,     /* Block is free */
   USED = 1,     /* Block is used */
   PREVFREE = 2, /* Previous block is free (optimized boundary tags) */
+  BUMP = 4,     /* Used block inside a chunk of short-lived ones */
+  HANDLE = 8,   /* Used block of mm_halloc(), may be moved */
 } bt_flags;
 
 // static word_t *heap_start; /* Address of the first block */
@@ -56,9 +233,60 @@ typedef enum {
 
 static const size_t footer_size = 4;
 static const size_t tags_size = 8;
-static size_t chunksize = 0;
-static size_t mem_heap_high = 0;
-static void *heap_listp = NULL;
+/* Largest request whose block size can be rounded up without wrapping. */
+#define MAX_REQUEST (SIZE_MAX - tags_size - ALIGNMENT)
+
+/* Heap the current operation works on. Everything below uses heap and
+ * heap_listp, so with NHEAPS > 1 every entry point sets it first. */
+static THREAD_LOCAL heap_t *heap = NULL;
+#define heap_listp ((void *)heap - sizeof(word_t))
+
+/* Adds n to a counter of the current heap. The relaxed one is for the few
+ * places that count without holding the lock of heap h. */
+#ifdef STATS
+#define STAT(name, n) (heap->counters.name += (n))
+#define STAT_RELAXED(h, name, n)                                               \
+  __atomic_fetch_add(&(h)->counters.name, (n), __ATOMIC_RELAXED)
+#else
+#define STAT(name, n) ((void)(n))
+#define STAT_RELAXED(h, name, n) ((void)(n))
+#endif
+
+#ifdef CHECKHEAP
+/* Notes a block for the next mm_checkheap(). Anything outside the current
+ * heap, like the prologue of a heap being set up, is left out. */
+static inline void check_touch(void *block) {
+  if (!heap || block <= heap_listp || (size_t)block >= heap->high)
+    return;
+  uint32_t n = heap->ndirty;
+  if (n < DIRTY_MAX)
+    heap->dirty[n] = block - heap_listp;
+  if (n <= DIRTY_MAX)
+    heap->ndirty = n + 1;
+}
+
+/* A block made at bt swallows the blocks that started inside it. */
+static inline void check_made(void *bt, size_t size) {
+  if (!heap || heap->ndirty > DIRTY_MAX)
+    return;
+  uint32_t lo = bt - heap_listp;
+  for (uint32_t i = 0; i < heap->ndirty;) {
+    if (heap->dirty[i] - lo - 1 < size - 1)
+      heap->dirty[i] = heap->dirty[--heap->ndirty];
+    else
+      i++;
+  }
+  check_touch(bt);
+}
+#else
+#define check_touch(block)
+#define check_made(bt, size)
+#endif
+
+#ifdef THREADS
+static __thread heap_t *thread_heap; /* where this thread mallocs */
+static __thread uint32_t thread_hot; /* how often its lock was contended */
+#endif
 
 #define round_up(size) ((size + ALIGNMENT - 1) & -ALIGNMENT)
 // static inline size_t round_up(size_t size) {
@@ -67,7 +295,7 @@ static void *heap_listp = NULL;
 
 /* --=[ boundary tag handling ]=-------------------------------------------- */
 
-#define bt_size(bt) (bt->header & ~(USED | PREVFREE))
+#define bt_size(bt) (bt->header & ~(USED | PREVFREE | BUMP | HANDLE))
 // static inline size_t bt_size(block_t *bt) {
 //   return bt->header & ~(USED | PREVFREE);
 // }
@@ -103,6 +331,7 @@ static inline void bt_make(block_t *bt, size_t size, bt_flags flags) {
   bt->header = value;
   size_t footer = (size_t)bt + size - footer_size;
   *(int32_t *)(footer) = value;
+  check_made(bt, size);
 }
 
 static inline uint32_t get_ptr_prev(block_t *bt) {
@@ -143,7 +372,7 @@ static inline void *bt_payload(word_t *bt) {
 /* Returns address of next block or NULL. */
 static inline void *bt_next(block_t *bt) {
   size_t size = bt_size(bt);
-  if ((long)(bt) + size + ALIGNMENT <= mem_heap_high) {
+  if ((long)(bt) + size + ALIGNMENT <= heap->high) {
     return (void *)((long)(bt) + size);
   }
   return NULL;
@@ -167,267 +396,1927 @@ static inline block_t *get_prev_free(block_t *block) {
   return heap_listp + get_ptr_prev(block);
 }
 
-/* --=[ miscellanous procedures ]=------------------------------------------ */
-
-/* Calculates block size incl. header, footer & payload,
- * and aligns it to block boundary (ALIGNMENT). */
-// static inline size_t blksz(size_t size) {
-// }
-
-// static void *morecore(size_t size) {
-//   void *ptr = mem_sbrk(size);
-//   if (ptr == (void *)-1)
-//     return NULL;
-//   return ptr;
-// }
-
-/* --=[ mm_init ]=---------------------------------------------------------- */
-// static size_t search; do heaury ale nie daje poprawy
-
-int mm_init(void) {
-  //   void *ptr = morecore(ALIGNMENT - sizeof(word_t));
-  //   if (!ptr)
-  //     return -1;
-  //   heap_start = NULL;
-  //   heap_end = NULL;
-  //   last = NULL;
-  //   return 0;
-  if ((long)mem_sbrk(ALIGNMENT - footer_size) < 0)
-    return -1;
-  size_t size = round_up(2);
-  // search = -1;
-  heap_listp = mem_sbrk(size);
-  mem_heap_high = (long)heap_listp + size;
-  bt_make(heap_listp, size, false);
-  set_ptr_prev(heap_listp, 0);
-  set_ptr_next(heap_listp, 0);
-  chunksize = (1 << 7);
-  return 0;
+/* Size of a free block as seen by the free list walk. */
+static inline size_t get_node_size(block_t *bt) {
+#ifdef FIT_NODE_SIZE
+  return bt->footer;
+#else
+  return bt_size(bt);
+#endif
 }
 
-static inline void remove_block(void *ptr) {
-  set_ptr_next(get_prev_free(ptr), get_ptr_next(ptr));
-  set_ptr_prev(get_next_free(ptr), get_ptr_prev(ptr));
+/* Bring the list node of the block at given offset into cache. */
+static inline void prefetch_node(uint32_t offset) {
+  __builtin_prefetch(heap_listp + offset + offsetof(block_t, ptr_next));
 }
 
-static inline void add_to_end(void *ptr) {
-  uint32_t ptr_cmp = ptr - heap_listp;
-  uint32_t last_block_ptr = get_ptr_prev(heap_listp);
-  block_t *last_block = get_prev_free(heap_listp);
+/* --=[ side index ]=------------------------------------------------------ */
 
-  set_ptr_next(last_block, ptr_cmp);
-  set_ptr_next(ptr, 0);
-  set_ptr_prev(heap_listp, ptr_cmp);
-  set_ptr_prev(ptr, last_block_ptr);
+#ifdef SIDE_INDEX
+/* The smallest block has a class of its own, so free blocks from classes
+ * >= FIRST_RANGE_CLASS are at least 32 bytes and the word after ptr_next
+ * is free to hold the block's slot in the index. */
+static inline int32_t *idx_sizes(void) {
+  return heap_listp + heap->idx_array;
 }
 
-static inline void set_block_free(void *bt, size_t size) {
-  bt_make(bt, size, false);
-  add_to_end(bt);
+static inline uint32_t *idx_offs(void) {
+  return (uint32_t *)(idx_sizes() + heap->idx_cap);
 }
 
-/* --=[ malloc ]=----------------------------------------------------------- */
+static inline void index_add(block_t *block, size_t size) {
+  uint32_t n = heap->idx_count;
+  if (n == heap->idx_cap) {
+    heap->idx_valid = false;
+    return;
+  }
+  idx_sizes()[n] = size;
+  idx_offs()[n] = (void *)block - heap_listp;
+  block->footer = n;
+  heap->idx_count = n + 1;
+}
 
-#if 0
-/* First fit startegy. */
-static word_t *find_fit(size_t reqsz) {
+/* Moves the last entry into the hole, so it is O(1) but touches the block
+ * the moved entry describes. */
+static inline void index_remove(block_t *block) {
+  uint32_t slot = block->footer;
+  uint32_t last = --heap->idx_count;
+  int32_t *sizes = idx_sizes();
+  uint32_t *offs = idx_offs();
+
+  if (slot != last) {
+    sizes[slot] = sizes[last];
+    offs[slot] = offs[last];
+    ((block_t *)(heap_listp + offs[slot]))->footer = slot;
+  }
 }
-#else
-/* Best fit startegy. */
-static uint32_t too_long = (1 << 9); //(1<<8) + (1<<7) + (1<<6);
 
-static block_t *find_fit(size_t size) {
-  block_t *fit_block = NULL;
-  block_t *work_block = heap_listp;
-  size_t fit_size = 0;
-  size_t work_size;
-  uint32_t count = 0;
+/* True best fit over all indexed blocks, NULL if none is big enough. */
+static block_t *index_fit(size_t size) {
+  int32_t *sizes = idx_sizes();
+  uint32_t n = heap->idx_count;
+  uint32_t i = 0;
+  int32_t best = INT32_MAX;
+  uint32_t best_i = 0;
+
+#if defined(__AVX2__)
+  if (n >= 8) {
+    __m256i req = _mm256_set1_epi32(size - 1);
+    __m256i none = _mm256_set1_epi32(INT32_MAX);
+    __m256i vbest = none;
+    __m256i vidx = _mm256_setzero_si256();
+    __m256i cur = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i step = _mm256_set1_epi32(8);
+    int32_t lane_best[8];
+    uint32_t lane_idx[8];
+
+    for (; i + 8 <= n; i += 8) {
+      __m256i v = _mm256_loadu_si256((__m256i *)(sizes + i));
+      v = _mm256_blendv_epi8(none, v, _mm256_cmpgt_epi32(v, req));
+      vidx = _mm256_blendv_epi8(vidx, cur, _mm256_cmpgt_epi32(vbest, v));
+      vbest = _mm256_min_epi32(vbest, v);
+      cur = _mm256_add_epi32(cur, step);
+    }
+    _mm256_storeu_si256((__m256i *)lane_best, vbest);
+    _mm256_storeu_si256((__m256i *)lane_idx, vidx);
+    for (int j = 0; j < 8; j++) {
+      if (lane_best[j] < best) {
+        best = lane_best[j];
+        best_i = lane_idx[j];
+      }
+    }
+  }
+#elif defined(__SSE4_1__)
+  if (n >= 4) {
+    __m128i req = _mm_set1_epi32(size - 1);
+    __m128i none = _mm_set1_epi32(INT32_MAX);
+    __m128i vbest = none;
+    __m128i vidx = _mm_setzero_si128();
+    __m128i cur = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i step = _mm_set1_epi32(4);
+    int32_t lane_best[4];
+    uint32_t lane_idx[4];
+
+    for (; i + 4 <= n; i += 4) {
+      __m128i v = _mm_loadu_si128((__m128i *)(sizes + i));
+      v = _mm_blendv_epi8(none, v, _mm_cmpgt_epi32(v, req));
+      vidx = _mm_blendv_epi8(vidx, cur, _mm_cmpgt_epi32(vbest, v));
+      vbest = _mm_min_epi32(vbest, v);
+      cur = _mm_add_epi32(cur, step);
+    }
+    _mm_storeu_si128((__m128i *)lane_best, vbest);
+    _mm_storeu_si128((__m128i *)lane_idx, vidx);
+    for (int j = 0; j < 4; j++) {
+      if (lane_best[j] < best) {
+        best = lane_best[j];
+        best_i = lane_idx[j];
+      }
+    }
+  }
+#endif
 
-  while ((work_block = get_next_free(work_block)) != heap_listp) {
-    work_size = bt_size(work_block);
-    if (work_size >= size && (fit_block == NULL || work_size < fit_size)) {
-      fit_block = work_block;
-      fit_size = work_size;
+  for (; i < n; i++) {
+    if (sizes[i] >= (int32_t)size && sizes[i] < best) {
+      best = sizes[i];
+      best_i = i;
     }
-    if (count == too_long)
-      break;
-    count++;
   }
 
-  if (fit_block != NULL) {
-    size_t diff = fit_size - size;
+  if (best == INT32_MAX)
+    return NULL;
+  return heap_listp + idx_offs()[best_i];
+}
 
-    if (diff >= 16) {
-      block_t *new_free = (block_t *)((long)fit_block + size);
-      set_block_free(new_free, diff);
-      remove_block(fit_block);
-      bt_make(fit_block, size, true);
-    } else {
-      remove_block(fit_block);
-      bt_make(fit_block, fit_size, true);
+static void *heap_malloc(size_t size);
+static void heap_free(void *ptr);
+
+/* Makes sure the next malloc or free finds room in the index. The array
+ * itself is a heap block, so while it is being replaced the index is off
+ * and afterwards it gets rebuilt from the free lists. */
+static void index_reserve(void) {
+  if (heap->idx_valid && heap->idx_count + 2 <= heap->idx_cap)
+    return;
+  if (heap->idx_busy)
+    return;
+
+  heap->idx_busy = true;
+  heap->idx_valid = false;
+
+  uint32_t n = 0;
+  for (int k = FIRST_RANGE_CLASS; k < NCLASSES; k++)
+    for (uint32_t b = heap->free_list[k]; b; b = get_ptr_next(heap_listp + b))
+      n++;
+
+  uint32_t cap = 2 * n + 8 > 64 ? 2 * n + 8 : 64;
+  void *array = heap_malloc(cap * (sizeof(int32_t) + sizeof(uint32_t)));
+  if (heap->idx_array)
+    heap_free(heap_listp + heap->idx_array);
+  heap->idx_array = array ? array - heap_listp : 0;
+  heap->idx_cap = array ? cap : 0;
+  heap->idx_count = 0;
+
+  if (array) {
+    heap->idx_valid = true;
+    for (int k = FIRST_RANGE_CLASS; k < NCLASSES; k++) {
+      for (uint32_t b = heap->free_list[k]; b;) {
+        block_t *block = heap_listp + b;
+        index_add(block, bt_size(block));
+        b = get_ptr_next(block);
+      }
     }
   }
 
-  return fit_block;
+  heap->idx_busy = false;
 }
+#endif
 
-static inline void *increase(size_t size) {
-  chunksize = size > chunksize          ? size
-              : size > (chunksize >> 7) ? chunksize
-                                        : size;
+/* --=[ miscellanous procedures ]=------------------------------------------ */
 
-  void *ptr;
-  size_t diff = chunksize - size;
+/* Calculates block size incl. header, footer & payload,
+ * and aligns it to block boundary (ALIGNMENT). */
+// static inline size_t blksz(size_t size) {
+// }
 
-  if (diff >= 64) {
-    ptr = mem_sbrk(chunksize);
+// static void *morecore(size_t size) {
+//   void *ptr = mem_sbrk(size);
+//   if (ptr == (void *)-1)
+//     return NULL;
+//   return ptr;
+// }
 
-    if ((long)ptr > 0) {
-      mem_heap_high += chunksize;
-      set_block_free(ptr + size, diff);
+/* --=[ locking ]=---------------------------------------------------------- */
+
+/* In the thread-safe build every operation holds the lock of its heap,
+ * except free: a block of another thread's heap, or of its own heap when
+ * the lock is taken, is pushed onto heap->remote instead. The whole batch
+ * is freed by the next malloc on that heap that finds no fit, when the heap
+ * is handed to a thread, or by mm_stats() and mm_checkheap(). So a heap no
+ * thread allocates from holds its remote blocks until one of the latter. */
+#ifdef THREADS
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
 
-      return ptr;
-    }
+/* Returns true if the lock was contended. */
+static inline bool heap_lock(void) {
+  bool contended = pthread_mutex_trylock(&heap->lock) != 0;
+  if (contended) {
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&heap->lock);
+    heap->stats.wait_ns += now_ns() - start;
+    heap->stats.contended++;
   }
+  heap->stats.locks++;
+  return contended;
+}
 
-  ptr = mem_sbrk(size);
-  if ((long)ptr > 0) {
-    mem_heap_high += size;
+static inline bool heap_trylock(void) {
+  return pthread_mutex_trylock(&heap->lock) == 0;
+}
 
-    return ptr;
-  }
+/* Like heap_lock(), but left out of the counters, for code reading them. */
+static inline void heap_lock_quiet(void) {
+  pthread_mutex_lock(&heap->lock);
+}
 
-  return (void *)(-1);
+static inline void heap_unlock(void) {
+  pthread_mutex_unlock(&heap->lock);
+}
+#else
+static inline bool heap_lock(void) {
+  return false;
 }
 
+static inline void heap_lock_quiet(void) {
+}
+
+static inline void heap_unlock(void) {
+}
 #endif
 
-void *malloc(size_t size) {
+/* --=[ class fronts ]=----------------------------------------------------- */
+
+#ifdef CLASS_LOCKS
+/* With CLASS_LOCKS the heap lock only guards coalescing. Blocks of exactly
+ * their class size, up to FRONT_MAX bytes, are freed into a front list of
+ * their class and malloc takes them back from there, so threads that use
+ * different sizes do not meet on a lock. Blocks in a front stay marked used
+ * and a front holding FRONT_DEPTH of them lets the rest through. */
+#define FRONT_MAX 4096
+#define FRONT_DEPTH 256
+#define TREIBER_MAX 64
+
+static inline uint64_t lock_clock(void) {
+#ifdef __x86_64__
+  return __builtin_ia32_rdtsc();
+#else
+  return now_ns();
+#endif
+}
 
-  size = round_up(tags_size + size);
+static inline void front_lock(front_t *f) {
+  if (__atomic_exchange_n(&f->lock, 1, __ATOMIC_ACQUIRE)) {
+    uint64_t start = lock_clock();
+    do {
+      while (__atomic_load_n(&f->lock, __ATOMIC_RELAXED))
+        sched_yield();
+    } while (__atomic_exchange_n(&f->lock, 1, __ATOMIC_ACQUIRE));
+    f->stats.wait_ticks += lock_clock() - start;
+    f->stats.contended++;
+  }
+  f->stats.locks++;
+  f->hold_start = lock_clock();
+}
 
-  block_t *block;
+static inline void front_unlock(front_t *f) {
+  f->stats.hold_ticks += lock_clock() - f->hold_start;
+  __atomic_store_n(&f->lock, 0, __ATOMIC_RELEASE);
+}
 
-  if ((block = find_fit(size)) != NULL) {
-    return &(block->ptr_prev);
+static bool treiber_push(front_t *f, block_t *block) {
+  if (__atomic_fetch_add(&f->count, 1, __ATOMIC_RELAXED) >= FRONT_DEPTH) {
+    __atomic_fetch_sub(&f->count, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  uint64_t offset = (void *)block - heap_listp;
+  uint64_t top = __atomic_load_n(&f->top, __ATOMIC_RELAXED);
+  for (;;) {
+    set_ptr_next(block, (uint32_t)top);
+    if (__atomic_compare_exchange_n(&f->top, &top,
+                                    offset | ((top >> 32) + 1) << 32, true,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      break;
+    __atomic_fetch_add(&f->stats.contended, 1, __ATOMIC_RELAXED);
   }
+  __atomic_fetch_add(&f->stats.locks, 1, __ATOMIC_RELAXED);
+  return true;
+}
 
-  // if(size < search)search = size;
-  block = increase(size);
-  if ((long)block < 0)
-    return NULL;
+/* The next link may be read from a block another thread has just popped,
+ * then the tag has moved on and the exchange fails. */
+static block_t *treiber_pop(front_t *f) {
+  uint64_t top = __atomic_load_n(&f->top, __ATOMIC_ACQUIRE);
+  block_t *block;
+  for (;;) {
+    if (!(uint32_t)top)
+      return NULL;
+    block = heap_listp + (uint32_t)top;
+    uint64_t next = __atomic_load_n(&block->ptr_next, __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&f->top, &top,
+                                    next | ((top >> 32) + 1) << 32, true,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+      break;
+    __atomic_fetch_add(&f->stats.contended, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_sub(&f->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&f->stats.locks, 1, __ATOMIC_RELAXED);
+  return block;
+}
 
-  bt_make(block, size, true);
+/* Takes a block of class k from the front of the current heap. */
+static block_t *front_pop(int k) {
+  front_t *f = &heap->front[k];
+  if (class_size[k] <= TREIBER_MAX)
+    return treiber_pop(f);
+  if (!f->top)
+    return NULL;
 
-  return &(block->ptr_prev);
+  front_lock(f);
+  block_t *block = NULL;
+  if (f->top) {
+    block = heap_listp + f->top;
+    f->top = get_ptr_next(block);
+    f->count--;
+  }
+  front_unlock(f);
+  return block;
 }
 
-/* --=[ free ]=------------------------------------------------------------- */
-
-static inline void *coalesce(block_t *block) {
-  block_t *prev_block = bt_prev(block);
-  block_t *next_block = bt_next(block);
-  bool prev_alloc = bt_used(prev_block);
-  bool next_alloc = bt_used(next_block);
+/* Returns false if the block has to go to the coalescing heap. */
+static bool front_push(block_t *block) {
   size_t size = bt_size(block);
-
-  uint16_t val = (prev_alloc << 1) + next_alloc;
-  switch (val) {
-    case 3:
-      add_to_end(block);
-      return block;
-    case 2:
-      remove_block(next_block);
-      size += bt_size(next_block);
-      bt_make(block, size, false);
-      break;
-    case 1:
-      remove_block(prev_block);
-      size += bt_size(prev_block);
-      block = prev_block;
-      bt_make(block, size, false);
-      break;
-    default:
-      remove_block(next_block);
-      remove_block(prev_block);
-      size += bt_size(next_block) + bt_size(prev_block);
-      block = prev_block;
-      bt_make(block, size, false);
-      break;
+  int k = size_class(size);
+  if (size != class_size[k] || size > FRONT_MAX)
+    return false;
+
+  front_t *f = &heap->front[k];
+  if (class_size[k] <= TREIBER_MAX)
+    return treiber_push(f, block);
+
+  bool pushed = false;
+  front_lock(f);
+  if (f->count < FRONT_DEPTH) {
+    set_ptr_next(block, f->top);
+    f->top = (void *)block - heap_listp;
+    f->count++;
+    pushed = true;
   }
+  front_unlock(f);
+  return pushed;
+}
+#endif
 
-  add_to_end(block);
+/* --=[ heaps ]=------------------------------------------------------------ */
 
-  return block;
+static inline void *heap_sbrk(size_t size) {
+  return NREGIONS > 1 ? mem_region_sbrk(heap->id, size) : mem_sbrk(size);
 }
 
-void free(void *ptr) {
-  if (ptr != NULL) {
-    // search = -1; heura ale nie daje poprawy
-    block_t *block = ptr - footer_size;
-    size_t size = bt_size(block);
+/* The header of heap i sits at a fixed spot of region i. */
+static inline heap_t *heap_get(int i) {
+  return mem_region_lo(i) + ALIGNMENT;
+}
 
-    bt_make(block, size, false);
+static inline heap_t *heap_of(void *ptr) {
+  return NREGIONS > 1 ? heap_get(mem_region_of(ptr)) : heap;
+}
 
-    block = coalesce(block);
-  }
+/* Lays out an empty heap in region i and makes it current. */
+static int heap_init(int i) {
+  if ((long)mem_region_sbrk(i, ALIGNMENT - footer_size) < 0)
+    return -1;
+  size_t size = round_up(tags_size + sizeof(heap_t));
+  // search = -1;
+  void *prologue = mem_region_sbrk(i, size);
+  if ((long)prologue < 0)
+    return -1;
+  heap = bt_payload(prologue);
+  memset(heap, 0, sizeof(heap_t));
+  heap->id = i;
+  heap->high = (long)prologue + size;
+  heap->chunksize = (1 << 7);
+#ifdef CHECKHEAP
+  heap->ndirty = DIRTY_MAX + 1;
+#endif
+  bt_make(prologue, size, true);
+#ifdef LARGE_HEAPS
+  heap->small = heap;
+#endif
+#ifdef THREADS
+  pthread_mutex_init(&heap->lock, NULL);
+  pthread_mutex_init(&heap->add_lock, NULL);
+#endif
+  return 0;
 }
 
-/* --=[ realloc ]=---------------------------------------------------------- */
+#ifdef THREADS
+/* Heaps other than 0 are set up when the first thread gets there. */
+static heap_t *heap_add(int i) {
+  heap_t *heap0 = heap_get(0);
+  heap_t *saved = heap;
+  heap_t *added = heap_get(i);
 
-static inline void *try_expand(block_t *block, size_t size) {
-  size_t csize = bt_size(block);
+  pthread_mutex_lock(&heap0->add_lock);
+  if (!mem_region_size(i) && heap_init(i) < 0)
+    added = NULL;
+  pthread_mutex_unlock(&heap0->add_lock);
 
-  // Sprawdza czy już zaalokowana pamięć razem z paddingiem nie jest
-  // wystarczająca
-  if (csize - tags_size >= size) {
-    return block;
-  }
+  heap = saved;
+  return added;
+}
 
-  block_t *next_block = bt_next(block);
-  if (next_block == NULL) {
-    size = round_up(size + tags_size);
-    increase(size - csize);
-    bt_make(block, size, true);
+static bool remote_drain(void);
+
+/* Frees what other threads left on the remote queue of h. */
+static void heap_drain(heap_t *h) {
+  if (!__atomic_load_n(&h->remote, __ATOMIC_RELAXED))
+    return;
+  heap_t *saved = heap;
+  heap = h;
+  heap_lock();
+  remote_drain();
+  heap_unlock();
+  heap = saved;
+}
 
-    return block;
+/* Picks a heap for the calling thread. A thread moved off a hot heap goes
+ * to the one with the fewest threads. The heap it gets starts with an
+ * empty remote queue. */
+static heap_t *heap_assign(heap_t *old) {
+  heap_t *heap0 = heap_get(0);
+  int i;
+
+  if (old) {
+    uint32_t best = UINT32_MAX;
+    i = old->id;
+    for (int j = 1; j < NHEAPS; j++) {
+      int k = (old->id + j) % NHEAPS;
+      uint32_t n = mem_region_size(k)
+                     ? __atomic_load_n(&heap_get(k)->nthreads, __ATOMIC_RELAXED)
+                     : 0;
+      if (n < best) {
+        best = n;
+        i = k;
+      }
+    }
+  } else {
+#ifdef HEAP_BY_CPU
+    i = sched_getcpu();
+    i = i < 0 ? 0 : i % NHEAPS;
+#else
+    i = __atomic_fetch_add(&heap0->next, 1, __ATOMIC_RELAXED) % NHEAPS;
+#endif
   }
 
-  bool next_alloc = bt_used(next_block);
-  size_t new_size = next_alloc ? 0 : csize + bt_size(next_block);
-  size = round_up(size + tags_size);
-  if (!next_alloc && new_size >= size) {
-    remove_block(next_block);
-    bt_make(block, new_size, true);
+  heap_t *new = heap_add(i);
+  if (!new)
+    return old ? old : heap0;
+  if (old)
+    __atomic_fetch_sub(&old->nthreads, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&new->nthreads, 1, __ATOMIC_RELAXED);
+  heap_drain(new);
+#ifdef LARGE_HEAPS
+  if (new->large)
+    heap_drain(new->large);
+#endif
+  return new;
+}
 
-    return block;
+/* Moves the thread elsewhere once its lock has been contended on about
+ * half of the recent mallocs. */
+#define HOT_STEP 32
+#define HOT_MAX (4 * HOT_STEP)
+
+static inline void heap_cool(bool contended) {
+  thread_hot -= thread_hot >> 3;
+  if (contended)
+    thread_hot += HOT_STEP;
+  if (NHEAPS > 1 && thread_hot > HOT_MAX) {
+    thread_heap = heap_assign(thread_heap);
+    thread_hot = 0;
   }
-
-  return NULL;
 }
 
-void *realloc(void *old_ptr, size_t size) {
-  /* If size == 0 then this is just free, and we return NULL. */
-  if (size == 0) {
-    free(old_ptr);
-    return NULL;
+int mm_heap_stats(int i, mm_heap_stats_t *stats) {
+  if (i < 0 || i >= NHEAPS)
+    return -1;
+  memset(stats, 0, sizeof(mm_heap_stats_t));
+  if (mem_region_size(i)) {
+    heap_t *h = heap_get(i);
+    pthread_mutex_lock(&h->lock);
+    *stats = h->stats;
+    stats->remote_frees =
+      __atomic_load_n(&h->stats.remote_frees, __ATOMIC_RELAXED);
+    stats->threads = __atomic_load_n(&h->nthreads, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&h->lock);
   }
+  return 0;
+}
 
-  /* If old_ptr is NULL, then this is just malloc. */
-  if (!old_ptr)
-    return malloc(size);
-
-  // Próba rozszerzenia już zaalokowanej pamięci
+int mm_class_stats(int i, int k, mm_lock_stats_t *stats) {
+  if (i < 0 || i >= NHEAPS || k < 0 || k >= NCLASSES)
+    return -1;
+  memset(stats, 0, sizeof(mm_lock_stats_t));
+#ifdef CLASS_LOCKS
+  if (mem_region_size(i))
+    *stats = heap_get(i)->front[k].stats;
+  return 0;
+#else
+  return -1;
+#endif
+}
+#endif
+
+#ifdef LARGE_HEAPS
+/* Partner of heap small in region small->id + NHEAPS, NULL if out of
+ * memory. */
+static heap_t *heap_large(heap_t *small) {
+  heap_t *large = __atomic_load_n(&small->large, __ATOMIC_ACQUIRE);
+  if (large)
+    return large;
+
+#ifdef THREADS
+  heap_t *heap0 = heap_get(0);
+  pthread_mutex_lock(&heap0->add_lock);
+#endif
+  heap_t *saved = heap;
+  if (!(large = small->large) && heap_init(small->id + NHEAPS) == 0) {
+    large = heap;
+    large->small = small;
+    large->large = large;
+    __atomic_store_n(&small->large, large, __ATOMIC_RELEASE);
+  }
+  heap = saved;
+#ifdef THREADS
+  pthread_mutex_unlock(&heap0->add_lock);
+#endif
+  return large;
+}
+#endif
+
+/* Heap a malloc of size bytes by the calling thread goes to. */
+static inline heap_t *heap_for(size_t size) {
+#ifdef THREADS
+  if (!thread_heap)
+    thread_heap = heap_assign(NULL);
+  heap_t *home = thread_heap;
+#elif defined(LARGE_HEAPS)
+  heap_t *home = heap->small;
+#else
+  heap_t *home = heap;
+#endif
+#ifdef LARGE_HEAPS
+  if (round_up(tags_size + size) >= LARGE_MIN)
+    return heap_large(home);
+#endif
+  return home;
+}
+
+/* --=[ per-CPU cache ]=---------------------------------------------------- */
+
+#ifdef CPU_CACHE
+#if !defined(THREADS) || !defined(__x86_64__)
+#error "CPU_CACHE needs the thread-safe build on x86-64"
+#endif
+
+/* Blocks of exactly their class size, up to CACHE_MAX bytes, are kept in a
+ * stack per CPU and class in front of the heaps. Push and pop are rseq
+ * critical sections: if the thread gets preempted or migrated before the
+ * final store, the kernel sends it to the abort label, so the stacks need
+ * neither locks nor atomics. Without rseq the cache is left out and every
+ * call goes to the locked heaps. Cached blocks stay marked used, and there
+ * is at most ncpus * nclasses * CACHE_DEPTH of them. */
+#define CACHE_MAX 256
+#define CACHE_DEPTH 32
+
+typedef struct {
+  uint32_t count;
+  void *slot[CACHE_DEPTH];
+} cpu_stack_t;
+
+typedef struct {
+  uint32_t ncpus;
+  uint32_t nclasses;   /* classes below this one are cached */
+  cpu_stack_t stack[]; /* class k on CPU c is at c * nclasses + k */
+} cpu_cache_t;
+
+static __thread cpu_cache_t *thread_cache;
+
+#define RSEQ_STR_(x) #x
+#define RSEQ_STR(x) RSEQ_STR_(x)
+
+/* Descriptor, registration and CPU check; the sequence runs from 1 to 2. */
+#define RSEQ_START                                                            \
+  ".pushsection __rseq_cs, \"aw\"\n\t"                                        \
+  ".balign 32\n\t"                                                            \
+  "3:\n\t"                                                                    \
+  ".long 0, 0\n\t"                                                            \
+  ".quad 1f, (2f - 1f), 4f\n\t"                                               \
+  ".popsection\n\t"                                                           \
+  "leaq 3b(%%rip), %%rax\n\t"                                                 \
+  "movq %%rax, %[rseq_cs]\n\t"                                                \
+  "1:\n\t"                                                                    \
+  "cmpl %[cpu], %[cpu_id]\n\t"                                                \
+  "jnz 4f\n\t"
+
+/* The abort handler has to follow the signature glibc registered. */
+#define RSEQ_END                                                              \
+  "2:\n\t"                                                                    \
+  ".pushsection __rseq_failure, \"ax\"\n\t"                                   \
+  ".byte 0x0f, 0xb9, 0x3d\n\t"                                                \
+  ".long " RSEQ_STR(RSEQ_SIG) "\n\t"                                          \
+  "4:\n\t"                                                                    \
+  "jmp %l[abort]\n\t"                                                         \
+  ".popsection\n\t"
+
+static inline struct rseq *thread_rseq(void) {
+  return __builtin_thread_pointer() + __rseq_offset;
+}
+
+/* Returns 0 and the block, 1 if the stack is empty, -1 if aborted. */
+static inline int rseq_pop(struct rseq *rs, uint32_t cpu, cpu_stack_t *st,
+                           void **item) {
+  __asm__ goto(RSEQ_START
+               "movl %[count], %%ecx\n\t"
+               "testl %%ecx, %%ecx\n\t"
+               "jz %l[empty]\n\t"
+               "decl %%ecx\n\t"
+               "movq (%[slots], %%rcx, 8), %%rdx\n\t"
+               "movq %%rdx, (%[item])\n\t"
+               "movl %%ecx, %[count]\n\t" RSEQ_END
+               :
+               : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id),
+                 [cpu] "r"(cpu), [count] "m"(st->count),
+                 [slots] "r"(st->slot), [item] "r"(item)
+               : "memory", "cc", "rax", "rcx", "rdx"
+               : abort, empty);
+  return 0;
+abort:
+  return -1;
+empty:
+  return 1;
+}
+
+/* Returns 0 if pushed, 1 if the stack is full, -1 if aborted. */
+static inline int rseq_push(struct rseq *rs, uint32_t cpu, cpu_stack_t *st,
+                            void *item) {
+  __asm__ goto(RSEQ_START
+               "movl %[count], %%ecx\n\t"
+               "cmpl %[depth], %%ecx\n\t"
+               "jae %l[full]\n\t"
+               "movq %[item], (%[slots], %%rcx, 8)\n\t"
+               "incl %%ecx\n\t"
+               "movl %%ecx, %[count]\n\t" RSEQ_END
+               :
+               : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id),
+                 [cpu] "r"(cpu), [count] "m"(st->count),
+                 [slots] "r"(st->slot), [item] "r"(item),
+                 [depth] "i"(CACHE_DEPTH)
+               : "memory", "cc", "rax", "rcx"
+               : abort, full);
+  return 0;
+abort:
+  return -1;
+full:
+  return 1;
+}
+
+static inline cpu_cache_t *cache_get(void) {
+  if (!thread_cache)
+    thread_cache = heap_get(0)->cache;
+  return thread_cache;
+}
+
+static void *cache_pop(cpu_cache_t *cache, int k) {
+  struct rseq *rs = thread_rseq();
+  void *item;
+
+  for (;;) {
+    uint32_t cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+    if (cpu >= cache->ncpus || (int32_t)rs->cpu_id < 0)
+      return NULL;
+    int r = rseq_pop(rs, cpu, &cache->stack[cpu * cache->nclasses + k], &item);
+    if (r >= 0)
+      return r ? NULL : item;
+  }
+}
+
+static bool cache_push(cpu_cache_t *cache, int k, void *item) {
+  struct rseq *rs = thread_rseq();
+
+  for (;;) {
+    uint32_t cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+    if (cpu >= cache->ncpus || (int32_t)rs->cpu_id < 0)
+      return false;
+    int r = rseq_push(rs, cpu, &cache->stack[cpu * cache->nclasses + k], item);
+    if (r >= 0)
+      return r == 0;
+  }
+}
+
+static void *heap_malloc(size_t size);
+
+/* Called by mm_init with heap 0 current. */
+static void cache_init(void) {
+  thread_cache = NULL;
+  if (!__rseq_size)
+    return;
+
+  uint32_t ncpus = get_nprocs_conf();
+  uint32_t nclasses = 0;
+  while (class_size[nclasses] <= CACHE_MAX)
+    nclasses++;
+
+  size_t size = sizeof(cpu_cache_t) + ncpus * nclasses * sizeof(cpu_stack_t);
+  cpu_cache_t *cache = heap_malloc(size);
+  if (!cache)
+    return;
+  memset(cache, 0, size);
+  cache->ncpus = ncpus;
+  cache->nclasses = nclasses;
+  heap->cache = cache;
+}
+#endif
+
+/* --=[ events ]=----------------------------------------------------------- */
+
+/* Each thread records its calls into a ring of its own, overwriting the
+ * oldest ones. Rings are mapped outside the heaps, so they outlive
+ * mm_init() and the thread, and a dump does not depend on the heap being
+ * intact. A call made from another one, like the malloc inside realloc,
+ * is part of the outer call. */
+#ifdef EVENTS
+#ifndef EVENT_RING
+#define EVENT_RING (1 << 16)
+#endif
+
+#if EVENT_RING & (EVENT_RING - 1)
+#error "EVENT_RING must be a power of two"
+#endif
+
+typedef struct ring {
+  struct ring *next; /* rings of all threads so far */
+  uint32_t thread;   /* threads are numbered by their first call */
+  uint64_t count;    /* events since mm_init(), the last EVENT_RING stay */
+  mm_event_t ev[EVENT_RING];
+} ring_t;
+
+static ring_t *rings;         /* pushed to, never taken from */
+static const char *dump_path; /* for the signal handler */
+
+/* The call the thread is in. */
+static THREAD_LOCAL struct {
+  ring_t *ring;
+  uint64_t start;
+  uint32_t nest;
+  uint16_t probes;
+  uint8_t path;
+} ev;
+
+static inline uint64_t event_clock(void) {
+#ifdef __x86_64__
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/* Maps the ring of the calling thread when it first needs one. */
+static ring_t *event_ring(void) {
+  ring_t *ring = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED)
+    return NULL;
+  ring_t *head = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  do {
+    ring->next = head;
+    ring->thread = head ? head->thread + 1 : 0;
+  } while (!__atomic_compare_exchange_n(&rings, &head, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  return ev.ring = ring;
+}
+
+static inline void event_begin(void) {
+  if (ev.nest++ == 0) {
+    ev.probes = 0;
+    ev.path = MM_PATH_NONE;
+    ev.start = event_clock();
+  }
+}
+
+static inline void event_path(int path) {
+  ev.path = path;
+}
+
+static inline void event_probe(void) {
+  ev.probes++;
+}
+
+/* The slot is filled in before it is counted, so a dump from a signal
+ * handler sees whole events. */
+static void event_add(int op, void *ptr, uintptr_t arg, size_t size,
+                      uint64_t ticks) {
+  ring_t *ring = ev.ring ? ev.ring : event_ring();
+  if (!ring)
+    return;
+  mm_event_t *e = &ring->ev[ring->count & (EVENT_RING - 1)];
+  e->time = ev.start;
+  e->ptr = (uintptr_t)ptr;
+  e->arg = arg;
+  e->size = size;
+  e->ticks = ticks < UINT32_MAX ? ticks : UINT32_MAX;
+  e->probes = ev.probes;
+  e->op = op;
+  e->path = ev.path;
+  __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+/* Records the call as it returns, unless it is part of another one. */
+static inline void event_end(int op, void *ptr, uintptr_t arg, size_t size) {
+  if (--ev.nest == 0)
+    event_add(op, ptr, arg, size, event_clock() - ev.start);
+}
+
+/* Same for a batch, one event per block that is not NULL. */
+static void event_end_many(int op, void **ptrs, size_t n, size_t size) {
+  if (--ev.nest)
+    return;
+  uint64_t ticks = event_clock() - ev.start;
+  for (size_t i = 0; i < n; i++)
+    if (ptrs[i])
+      event_add(op, ptrs[i], 0, size, ticks);
+}
+
+static void event_reset(void) {
+  for (ring_t *ring = rings; ring; ring = ring->next)
+    ring->count = 0;
+}
+
+static bool event_write(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* Only open, write and close, so a signal handler may call it. Events
+ * recorded meanwhile may or may not make it into the dump. */
+int mm_events_dump(const char *path) {
+  int saved_errno = errno;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+
+  uint32_t header[2] = {MM_EVENTS_MAGIC, sizeof(mm_event_t)};
+  bool ok = event_write(fd, header, sizeof(header));
+  ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  for (; ring && ok; ring = ring->next) {
+    uint64_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+    uint32_t n = count < EVENT_RING ? count : EVENT_RING;
+    uint32_t first = (count - n) & (EVENT_RING - 1);
+    uint32_t upto_end = EVENT_RING - first < n ? EVENT_RING - first : n;
+    uint32_t info[2] = {ring->thread, n};
+    ok = event_write(fd, info, sizeof(info)) &&
+         event_write(fd, &ring->ev[first], upto_end * sizeof(mm_event_t)) &&
+         event_write(fd, ring->ev, (n - upto_end) * sizeof(mm_event_t));
+  }
+
+  if (close(fd) < 0)
+    ok = false;
+  errno = saved_errno;
+  return ok ? 0 : -1;
+}
+
+static void event_signal(__unused int sig) {
+  mm_events_dump(dump_path);
+}
+
+int mm_events_on_signal(int sig, const char *path) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = event_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  dump_path = path;
+  return sigaction(sig, &sa, NULL);
+}
+#else
+#define event_begin()
+#define event_path(path)
+#define event_probe()
+#define event_end(op, ptr, arg, size)
+#define event_end_many(op, ptrs, n, size)
+#define event_reset()
+
+int mm_events_dump(__unused const char *path) {
+  return -1;
+}
+
+int mm_events_on_signal(__unused int sig, __unused const char *path) {
+  return -1;
+}
+#endif
+
+/* --=[ mm_init ]=---------------------------------------------------------- */
+// static size_t search; do heaury ale nie daje poprawy
+
+int mm_init(void) {
+  //   void *ptr = morecore(ALIGNMENT - sizeof(word_t));
+  //   if (!ptr)
+  //     return -1;
+  //   heap_start = NULL;
+  //   heap_end = NULL;
+  //   last = NULL;
+  //   return 0;
+  if (heap_init(0) < 0)
+    return -1;
+#ifdef THREADS
+  /* Other threads must not outlive the heaps they were assigned to. */
+  thread_heap = heap;
+  thread_hot = 0;
+  heap->nthreads = 1;
+#endif
+#ifdef CPU_CACHE
+  cache_init();
+#endif
+  event_reset();
+  return 0;
+}
+
+static inline void remove_block(block_t *block) {
+  uint32_t prev = get_ptr_prev(block);
+  uint32_t next = get_ptr_next(block);
+
+  if (prev)
+    check_touch(heap_listp + prev);
+  if (next)
+    check_touch(heap_listp + next);
+
+  if (prev) {
+    set_ptr_next(heap_listp + prev, next);
+  } else {
+    int k = size_class(bt_size(block));
+    heap->free_list[k] = next;
+    if (!next)
+      heap->nonempty &= ~(1UL << k);
+  }
+  if (next)
+    set_ptr_prev(heap_listp + next, prev);
+#ifdef SIDE_INDEX
+  if (heap->idx_valid && size_class(bt_size(block)) >= FIRST_RANGE_CLASS)
+    index_remove(block);
+#endif
+}
+
+static inline void add_to_list(block_t *block) {
+  uint32_t ptr_cmp = (void *)block - heap_listp;
+  int k = size_class(bt_size(block));
+  uint32_t first = heap->free_list[k];
+
+  set_ptr_prev(block, 0);
+  set_ptr_next(block, first);
+#ifdef FIT_NODE_SIZE
+  block->footer = bt_size(block);
+#endif
+  if (first) {
+    set_ptr_prev(heap_listp + first, ptr_cmp);
+    check_touch(heap_listp + first);
+  }
+  heap->free_list[k] = ptr_cmp;
+  heap->nonempty |= 1UL << k;
+#ifdef SIDE_INDEX
+  if (heap->idx_valid && k >= FIRST_RANGE_CLASS)
+    index_add(block, bt_size(block));
+#endif
+}
+
+static inline void set_block_free(void *bt, size_t size) {
+  bt_make(bt, size, false);
+  add_to_list(bt);
+}
+
+/* --=[ malloc ]=----------------------------------------------------------- */
+
+#if 0
+/* First fit startegy. */
+static word_t *find_fit(size_t reqsz) {
+}
+#else
+/* Best fit startegy. */
+static uint32_t too_long = (1 << 9); //(1<<8) + (1<<7) + (1<<6);
+
+/* Best fit within one size class, looking at most at too_long blocks. */
+static block_t *class_fit(int k, size_t size) {
+  block_t *fit_block = NULL;
+  size_t fit_size = 0;
+  size_t work_size;
+  uint32_t count = 0;
+
+  for (uint32_t work = heap->free_list[k]; work;) {
+    block_t *work_block = heap_listp + work;
+    uint32_t next = get_ptr_next(work_block);
+    STAT(fit_probes, 1);
+    event_probe();
+    // Następny węzeł ładuje się, zanim skończymy z bieżącym
+    if (next)
+      prefetch_node(next);
+    work_size = get_node_size(work_block);
+    if (work_size >= size && (fit_block == NULL || work_size < fit_size)) {
+      fit_block = work_block;
+      fit_size = work_size;
+      if (fit_size == size)
+        break;
+    }
+    if (count == too_long)
+      break;
+    count++;
+    work = next;
+  }
+
+  return fit_block;
+}
+
+/* Only the request's own class and the last one may hold blocks that are
+ * too small, so this finishes after at most two or three ctz lookups.
+ * Batches and placement call it too, which is no reason to make malloc()
+ * pay for a call. */
+static __always_inline block_t *find_fit(size_t size) {
+  int k = size_class(size);
+  uint64_t mask = heap->nonempty & (~0UL << k);
+  block_t *fit_block = NULL;
+
+  /* Heads of the first two candidate classes, the second one is where we
+   * go when the request's own class has nothing big enough. */
+  if (mask) {
+    prefetch_node(heap->free_list[__builtin_ctzl(mask)]);
+    uint64_t rest = mask & (mask - 1);
+    if (rest)
+      prefetch_node(heap->free_list[__builtin_ctzl(rest)]);
+  }
+
+  while (mask) {
+    k = __builtin_ctzl(mask);
+#ifdef SIDE_INDEX
+    if (k >= FIRST_RANGE_CLASS && heap->idx_valid) {
+      fit_block = index_fit(size);
+      break;
+    }
+#endif
+    if ((fit_block = class_fit(k, size)) != NULL)
+      break;
+    mask &= mask - 1;
+  }
+
+  if (fit_block != NULL) {
+    size_t fit_size = bt_size(fit_block);
+    size_t diff = fit_size - size;
+
+    remove_block(fit_block);
+    if (diff >= 16) {
+      STAT(splits, 1);
+      block_t *new_free = (block_t *)((long)fit_block + size);
+      set_block_free(new_free, diff);
+      bt_make(fit_block, size, true);
+    } else {
+      bt_make(fit_block, fit_size, true);
+    }
+  }
+
+  return fit_block;
+}
+
+static inline void *increase(size_t size) {
+  size_t chunksize = heap->chunksize;
+  chunksize = size > chunksize          ? size
+              : size > (chunksize >> 7) ? chunksize
+                                        : size;
+  heap->chunksize = chunksize;
+
+  void *ptr;
+  size_t diff = chunksize - size;
+
+  if (diff >= 64) {
+    ptr = heap_sbrk(chunksize);
+
+    if ((long)ptr > 0) {
+      heap->high += chunksize;
+      STAT(extensions, 1);
+      STAT(extended_bytes, chunksize);
+      set_block_free(ptr + size, diff);
+
+      return ptr;
+    }
+  }
+
+  ptr = heap_sbrk(size);
+  if ((long)ptr > 0) {
+    heap->high += size;
+    STAT(extensions, 1);
+    STAT(extended_bytes, size);
+
+    return ptr;
+  }
+
+  return (void *)(-1);
+}
+
+#endif
+
+#ifdef CACHELINE_FIT
+static void *heap_place(size_t size, size_t alignment, size_t span);
+#endif
+
+static void *heap_malloc(size_t size) {
+#ifdef CACHELINE_FIT
+  /* Up to ALIGNMENT bytes can not cross a line anyway. */
+  if (size > ALIGNMENT && size <= CACHE_LINE)
+    return heap_place(size, CACHE_LINE, size);
+#endif
+#ifdef SIDE_INDEX
+  index_reserve();
+#endif
+
+  size = round_up(tags_size + size);
+
+  block_t *block;
+
+  event_path(MM_PATH_FIT);
+  if ((block = find_fit(size)) != NULL) {
+    return &(block->ptr_prev);
+  }
+
+#ifdef THREADS
+  if (remote_drain() && (block = find_fit(size)) != NULL)
+    return &(block->ptr_prev);
+#endif
+
+  // if(size < search)search = size;
+  event_path(MM_PATH_EXTEND);
+  block = increase(size);
+  if ((long)block < 0)
+    return NULL;
+
+  bt_make(block, size, true);
+
+  return &(block->ptr_prev);
+}
+
+#ifdef LIFETIME
+static void *heap_malloc_hint(size_t size, int hint);
+#else
+/* Without LIFETIME a hint changes nothing. */
+static inline void *heap_malloc_hint(size_t size, __unused int hint) {
+  STAT(mallocs, 1);
+  return heap_malloc(size);
+}
+#endif
+
+static inline void *malloc_hint(size_t size, int hint) {
+  if (size > MAX_REQUEST)
+    return NULL;
+#ifdef THREADS
+#ifdef CPU_CACHE
+  cpu_cache_t *cache = cache_get();
+  int k = size_class(round_up(tags_size + size));
+  if (cache && k < cache->nclasses) {
+    void *ptr = cache_pop(cache, k);
+    if (ptr) {
+      event_path(MM_PATH_CACHE);
+      return ptr;
+    }
+    /* Make the block cacheable once it is freed. */
+    size = class_size[k] - tags_size;
+  }
+#endif
+  if (!(heap = heap_for(size)))
+    return NULL;
+#ifdef CLASS_LOCKS
+  int c = size_class(round_up(tags_size + size));
+  if (class_size[c] <= FRONT_MAX) {
+    block_t *block = front_pop(c);
+    if (block) {
+      event_path(MM_PATH_FRONT);
+      return &block->ptr_prev;
+    }
+    size = class_size[c] - tags_size;
+  }
+#endif
+  bool contended = heap_lock();
+  heap->stats.mallocs++;
+  void *ptr = heap_malloc_hint(size, hint);
+  heap_unlock();
+  heap_cool(contended);
+  return ptr;
+#elif defined(LARGE_HEAPS)
+  if (!(heap = heap_for(size)))
+    return NULL;
+  return heap_malloc_hint(size, hint);
+#else
+  /* The only heap there is stays current. */
+  return heap_malloc_hint(size, hint);
+#endif
+}
+
+void *malloc(size_t size) {
+  event_begin();
+  void *ptr = malloc_hint(size, MM_HINT_UNKNOWN);
+  event_end(MM_EV_MALLOC, ptr, 0, size);
+  return ptr;
+}
+
+void *mm_malloc_hint(size_t size, int hint) {
+  event_begin();
+  void *ptr = malloc_hint(size, hint);
+  event_end(MM_EV_MALLOC, ptr, 0, size);
+  return ptr;
+}
+
+int mm_block_hint(void *ptr) {
+  __unused block_t *block = ptr - footer_size;
+#ifdef LIFETIME
+  if (get_header(block) & BUMP)
+    return MM_HINT_SHORT;
+#endif
+  return MM_HINT_LONG;
+}
+
+/* --=[ lifetimes ]=-------------------------------------------------------- */
+
+#ifdef LIFETIME
+/* Blocks predicted to die young are bumped out of a chunk, a used block of
+ * the heap. They are never coalesced, so their footer holds the distance
+ * back to the chunk and, in the high half, the low half of the clock of
+ * the heap when they were made. A chunk counts its live blocks and is freed
+ * as a whole when the last one goes. The current chunk is rewound instead
+ * once it has no live blocks.
+ *
+ * Every free of a bumped block teaches the predictor of its class. So does
+ * every block that is still live and old when its chunk fills up, or a
+ * class that never frees would never be found out. Classes predicted to
+ * live long are still bumped now and then, so the predictor notices when
+ * they change. While the heap is small a chunk costs more than it saves. */
+#ifndef BUMP_CHUNK
+#define BUMP_CHUNK 1024
+#endif
+#define BUMP_MAX 256     /* biggest block worth bumping */
+#define BUMP_HEAP 65536  /* heap size to start bumping at */
+#define BUMP_SAMPLE 64   /* one in this many mallocs is bumped anyway */
+#define SCORE_MAX 15
+#define SCORE_MIN -16
+
+#if BUMP_CHUNK > (1 << 16)
+#error "bump_tag() keeps the distance to the chunk in 16 bits"
+#endif
+
+typedef struct {
+  uint32_t live; /* blocks bumped out of the chunk, plus one while current */
+} chunk_t;
+
+static inline chunk_t *chunk_get(block_t *chunk) {
+  return bt_payload((word_t *)chunk);
+}
+
+static inline uint32_t *bump_tag(block_t *block) {
+  return bt_footer(block);
+}
+
+/* Ages wrap around after 1 << 16 mallocs. */
+static inline bool bump_young(block_t *block) {
+  uint16_t born = *bump_tag(block) >> 16;
+  uint16_t now = __atomic_load_n(&heap->clock, __ATOMIC_RELAXED);
+  return (uint16_t)(now - born) < MM_SHORT_LIFE;
+}
+
+/* Short lives raise the score of a class slowly, long ones drop it fast:
+ * a long-lived block keeps a whole chunk from going back to the heap. */
+static inline void predict_learn(int k, bool young) {
+  int8_t score = __atomic_load_n(&heap->score[k], __ATOMIC_RELAXED);
+  if (young)
+    score = score < SCORE_MAX ? score + 1 : SCORE_MAX;
+  else
+    score = score > SCORE_MIN + 4 ? score - 4 : SCORE_MIN;
+  __atomic_store_n(&heap->score[k], score, __ATOMIC_RELAXED);
+}
+
+/* Looks for old blocks in a full chunk. Frees clear USED of a bumped block,
+ * a block freed during the walk may or may not be seen. */
+static void chunk_retire(block_t *chunk) {
+  block_t *end = heap_listp + heap->bump_cur;
+  block_t *block = (void *)chunk + ALIGNMENT;
+  for (; block < end; block = (void *)block + bt_size(block))
+    if ((get_header(block) & USED) && !bump_young(block))
+      predict_learn(size_class(bt_size(block)), false);
+}
+
+/* Takes a block of given size from the current chunk, called with the
+ * lock held. Returns NULL if a new chunk is needed and there is no memory. */
+static void *bump_malloc(size_t size) {
+  block_t *chunk = heap->bump ? heap_listp + heap->bump : NULL;
+  if (chunk) {
+    chunk_t *c = chunk_get(chunk);
+    if (__atomic_load_n(&c->live, __ATOMIC_ACQUIRE) == 1) {
+      heap->bump_cur = heap->bump + ALIGNMENT;
+    } else if (heap->bump_cur + size >
+               heap->bump + bt_size(chunk) - ALIGNMENT) {
+      chunk_retire(chunk);
+      /* Whoever frees the last block frees the chunk. */
+      if (__atomic_sub_fetch(&c->live, 1, __ATOMIC_ACQ_REL) == 0) {
+        c->live = 1;
+        heap->bump_cur = heap->bump + ALIGNMENT;
+      } else {
+        chunk = NULL;
+      }
+    }
+  }
+
+  if (!chunk) {
+    /* A chunk says nothing about sizes to come, increase() must not
+     * round up to it. */
+    size_t chunksize = heap->chunksize;
+    void *ptr = heap_malloc(BUMP_CHUNK - tags_size);
+    heap->chunksize = chunksize;
+    if (!ptr)
+      return NULL;
+    chunk = ptr - footer_size;
+    chunk_get(chunk)->live = 1;
+    heap->bump = (void *)chunk - heap_listp;
+    heap->bump_cur = heap->bump + ALIGNMENT;
+  }
+
+  block_t *block = heap_listp + heap->bump_cur;
+  heap->bump_cur += size;
+  block->header = size | USED | BUMP;
+  *bump_tag(block) = heap->clock << 16 | ((void *)block - (void *)chunk);
+  __atomic_add_fetch(&chunk_get(chunk)->live, 1, __ATOMIC_RELAXED);
+  event_path(MM_PATH_BUMP);
+  return &block->ptr_prev;
+}
+
+/* The lock is not needed, the chunk is freed by whoever drops the count
+ * to zero. */
+static void bump_free(block_t *block) {
+  block_t *chunk = (void *)block - (*bump_tag(block) & 0xffff);
+  chunk_t *c = chunk_get(chunk);
+  predict_learn(size_class(bt_size(block)), bump_young(block));
+  __atomic_and_fetch(&block->header, ~USED, __ATOMIC_RELAXED);
+  if (__atomic_sub_fetch(&c->live, 1, __ATOMIC_ACQ_REL) == 0)
+    free(bt_payload((word_t *)chunk));
+}
+#endif
+
+#ifdef LIFETIME
+static void *heap_malloc_hint(size_t size, int hint) {
+  STAT(mallocs, 1);
+  size_t bsize = round_up(tags_size + size);
+  uint32_t now = heap->clock++;
+  size_t heapsize = heap->high - (size_t)heap_listp;
+  if (bsize <= BUMP_MAX && hint != MM_HINT_LONG && heapsize >= BUMP_HEAP) {
+    int k = size_class(bsize);
+    if (hint == MM_HINT_SHORT || heap->score[k] > 0 ||
+        now % BUMP_SAMPLE == 0) {
+      void *ptr = bump_malloc(bsize);
+      if (ptr)
+        return ptr;
+    }
+  }
+  return heap_malloc(size);
+}
+#endif
+
+/* --=[ free ]=------------------------------------------------------------- */
+
+/* Inlined everywhere, like find_fit(), for the sake of free(). */
+static __always_inline void *coalesce(block_t *block) {
+  block_t *prev_block = bt_prev(block);
+  block_t *next_block = bt_next(block);
+  bool prev_alloc = bt_used(prev_block);
+  bool next_alloc = bt_used(next_block);
+  size_t size = bt_size(block);
+
+  uint16_t val = (prev_alloc << 1) + next_alloc;
+  STAT(coalesce[3 - val], 1);
+  switch (val) {
+    case 3:
+      add_to_list(block);
+      return block;
+    case 2:
+      remove_block(next_block);
+      size += bt_size(next_block);
+      bt_make(block, size, false);
+      break;
+    case 1:
+      remove_block(prev_block);
+      size += bt_size(prev_block);
+      block = prev_block;
+      bt_make(block, size, false);
+      break;
+    default:
+      remove_block(next_block);
+      remove_block(prev_block);
+      size += bt_size(next_block) + bt_size(prev_block);
+      block = prev_block;
+      bt_make(block, size, false);
+      break;
+  }
+
+  add_to_list(block);
+
+  return block;
+}
+
+static void heap_free(void *ptr) {
+#ifdef SIDE_INDEX
+  index_reserve();
+#endif
+  // search = -1; heura ale nie daje poprawy
+  block_t *block = ptr - footer_size;
+  size_t size = bt_size(block);
+
+  bt_make(block, size, false);
+
+  block = coalesce(block);
+}
+
+#ifdef THREADS
+/* Lock-free push, many threads may free at once. Blocks stay marked used,
+ * so nobody coalesces with them until they are drained. */
+static void remote_push(block_t *block) {
+  uint32_t offset = (void *)block - heap_listp;
+  uint32_t head = __atomic_load_n(&heap->remote, __ATOMIC_RELAXED);
+  do {
+    set_ptr_next(block, head);
+  } while (!__atomic_compare_exchange_n(&heap->remote, &head, offset, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Takes the whole batch at once, called with the lock held. */
+static bool remote_drain(void) {
+  uint32_t b = __atomic_exchange_n(&heap->remote, 0, __ATOMIC_ACQUIRE);
+  if (!b)
+    return false;
+  while (b) {
+    block_t *block = heap_listp + b;
+    b = get_ptr_next(block);
+    heap_free(&block->ptr_prev);
+    STAT(frees, 1);
+  }
+  return true;
+}
+#endif
+
+static inline void free_ptr(void *ptr) {
+  if (ptr == NULL)
+    return;
+#ifdef LIFETIME
+  block_t *bumped = ptr - footer_size;
+  if (get_header(bumped) & BUMP) {
+    heap = heap_of(ptr);
+    STAT_RELAXED(heap, frees, 1);
+    event_path(MM_PATH_BUMP);
+    bump_free(bumped);
+    return;
+  }
+#endif
+#ifdef CPU_CACHE
+  cpu_cache_t *cache = cache_get();
+  block_t *block = ptr - footer_size;
+  size_t size = bt_size(block);
+  int k = size_class(size);
+  if (cache && k < cache->nclasses && size == class_size[k] &&
+      cache_push(cache, k, ptr)) {
+    event_path(MM_PATH_CACHE);
+    return;
+  }
+#endif
+  heap = heap_of(ptr);
+#ifdef CLASS_LOCKS
+  if (front_push(ptr - footer_size)) {
+    event_path(MM_PATH_FRONT);
+    return;
+  }
+#endif
+#ifdef THREADS
+#ifdef LARGE_HEAPS
+  heap_t *home = heap->small;
+#else
+  heap_t *home = heap;
+#endif
+  if (home != thread_heap || !heap_trylock()) {
+    remote_push(ptr - footer_size);
+    __atomic_fetch_add(&heap->stats.remote_frees, 1, __ATOMIC_RELAXED);
+    event_path(MM_PATH_REMOTE);
+    return;
+  }
+  heap->stats.locks++;
+  heap->stats.frees++;
+#endif
+  STAT(frees, 1);
+  event_path(MM_PATH_HEAP);
+  heap_free(ptr);
+  heap_unlock();
+}
+
+void free(void *ptr) {
+  event_begin();
+  free_ptr(ptr);
+  event_end(MM_EV_FREE, ptr, 0, 0);
+}
+
+/* --=[ batches ]=---------------------------------------------------------- */
+
+#define BATCH_MAX (1 << 24) /* most bytes carved out of one free block */
+
+/* Cuts used block into n blocks of given size, the last one keeps the few
+ * bytes find_fit() did not split off. */
+static void batch_carve(block_t *block, size_t size, size_t n, void **out) {
+  size_t total = bt_size(block);
+  for (size_t i = 0; i < n - 1; i++, block = (void *)block + size) {
+    bt_make(block, size, true);
+    out[i] = &block->ptr_prev;
+  }
+  bt_make(block, total - (n - 1) * size, true);
+  out[n - 1] = &block->ptr_prev;
+}
+
+/* Takes blocks for as many objects as fit into one free block, halving the
+ * count while nothing fits, so a batch usually costs a single find_fit(). */
+static size_t heap_malloc_batch(size_t size, size_t n, void **out) {
+#ifdef SIDE_INDEX
+  index_reserve();
+#endif
+  size = round_up(tags_size + size);
+  size_t max = BATCH_MAX / size ? BATCH_MAX / size : 1;
+  size_t m = max;
+  size_t done = 0;
+
+  while (done < n) {
+    if (m > n - done)
+      m = n - done;
+    block_t *block = find_fit(m * size);
+#ifdef THREADS
+    if (!block && remote_drain())
+      block = find_fit(m * size);
+#endif
+    if (!block && m > 1) {
+      m >>= 1;
+      continue;
+    }
+    event_path(block ? MM_PATH_FIT : MM_PATH_EXTEND);
+    if (!block) {
+      m = n - done < max ? n - done : max;
+      block = increase(m * size);
+      if ((long)block < 0)
+        break;
+      bt_make(block, m * size, true);
+    }
+    batch_carve(block, size, m, out + done);
+    done += m;
+    STAT(mallocs, m);
+  }
+
+  return done;
+}
+
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+  if (n == 0 || size > MAX_REQUEST)
+    return 0;
+  if (!(heap = heap_for(size)))
+    return 0;
+  event_begin();
+#ifdef THREADS
+  bool contended = heap_lock();
+  size_t done = heap_malloc_batch(size, n, out);
+  heap->stats.mallocs += done;
+  heap_unlock();
+  heap_cool(contended);
+#else
+  size_t done = heap_malloc_batch(size, n, out);
+#endif
+  event_end_many(MM_EV_MALLOC, out, done, size);
+  return done;
+}
+
+static int ptr_order(const void *a, const void *b) {
+  uintptr_t x = *(const uintptr_t *)a;
+  uintptr_t y = *(const uintptr_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Sorted by address, neighbours in ptrs are often neighbours in the heap.
+ * Each run of them becomes one free block that is coalesced once. Batches
+ * from mm_malloc_batch() usually come back in order, so check that first. */
+void mm_free_batch(void **ptrs, size_t n) {
+#ifdef LIFETIME
+  /* Bumped blocks have no neighbours to merge with. */
+  for (size_t i = 0; i < n; i++) {
+    block_t *block = ptrs[i] ? ptrs[i] - footer_size : NULL;
+    if (block && (get_header(block) & BUMP)) {
+      free(ptrs[i]);
+      ptrs[i] = NULL;
+    }
+  }
+#endif
+  event_begin();
+  event_path(MM_PATH_HEAP);
+  size_t sorted = 1;
+  while (sorted < n && ptrs[sorted - 1] <= ptrs[sorted])
+    sorted++;
+  if (sorted < n)
+    qsort(ptrs, n, sizeof(void *), ptr_order);
+
+  size_t i = 0;
+  while (i < n && ptrs[i] == NULL)
+    i++;
+
+  while (i < n) {
+    heap = heap_of(ptrs[i]);
+    heap_lock();
+#ifdef SIDE_INDEX
+    index_reserve();
+#endif
+    size_t first = i;
+    do {
+      block_t *block = ptrs[i] - footer_size;
+      block_t *end = (void *)block + bt_size(block);
+      while (++i < n && ptrs[i] - footer_size == end)
+        end = (void *)end + bt_size(end);
+      bt_make(block, (void *)end - (void *)block, false);
+      coalesce(block);
+    } while (i < n && heap_of(ptrs[i]) == heap);
+#ifdef THREADS
+    heap->stats.frees += i - first;
+#endif
+    STAT(frees, i - first);
+    heap_unlock();
+  }
+  event_end_many(MM_EV_FREE, ptrs, n, 0);
+}
+
+/* --=[ memalign ]=--------------------------------------------------------- */
+
+/* Offset of the payload in the block at bt: none if the first span bytes
+ * of the payload stay within one alignment-sized unit, else up to the next
+ * unit. memalign() passes span = alignment, so any misalignment moves it. */
+static inline size_t place_lead(block_t *bt, size_t alignment, size_t span) {
+  size_t offset = ((size_t)bt + footer_size) & (alignment - 1);
+  return offset + span > alignment ? alignment - offset : 0;
+}
+
+/* Best fit among free blocks that can host such a payload, the way
+ * class_fit() looks, at most too_long blocks of each class. */
+static block_t *place_fit(size_t size, size_t alignment, size_t span) {
+  uint64_t mask = heap->nonempty & (~0UL << size_class(size));
+  block_t *fit_block = NULL;
+  size_t fit_size = 0;
+
+  while (mask && !fit_block) {
+    uint32_t count = 0;
+    uint32_t work = heap->free_list[__builtin_ctzl(mask)];
+    while (work && count++ <= too_long) {
+      block_t *work_block = heap_listp + work;
+      event_probe();
+      size_t work_size = bt_size(work_block);
+      size_t lead = place_lead(work_block, alignment, span);
+      if (lead + size <= work_size &&
+          (fit_block == NULL || work_size < fit_size)) {
+        fit_block = work_block;
+        fit_size = work_size;
+      }
+      work = get_ptr_next(work_block);
+    }
+    mask &= mask - 1;
+  }
+
+  if (fit_block != NULL) {
+    remove_block(fit_block);
+    bt_make(fit_block, fit_size, true);
+  }
+  return fit_block;
+}
+
+/* Takes a block with room for a payload placed by place_lead(), then gives
+ * the slack before and after the payload back as free blocks. */
+static void *heap_place(size_t size, size_t alignment, size_t span) {
+#ifdef SIDE_INDEX
+  index_reserve();
+#endif
+  /* Neither the block nor its padding may wrap around. */
+  if (size > MAX_REQUEST)
+    return NULL;
+  size = round_up(tags_size + size);
+  if (alignment - ALIGNMENT > SIZE_MAX - size)
+    return NULL;
+  /* Payloads are ALIGNMENT apart, so the slack in front is a multiple of it
+   * and always makes a whole block. A fresh block must fit the worst one. */
+  size_t padded = size + alignment - ALIGNMENT;
+
+  event_path(MM_PATH_FIT);
+  block_t *block = place_fit(size, alignment, span);
+#ifdef THREADS
+  if (!block && remote_drain())
+    block = place_fit(size, alignment, span);
+#endif
+  if (!block) {
+    event_path(MM_PATH_EXTEND);
+    block = increase(padded);
+    if ((long)block < 0)
+      return NULL;
+    bt_make(block, padded, true);
+  }
+
+  size_t total = bt_size(block);
+  size_t lead = place_lead(block, alignment, span);
+  block_t *placed = (void *)block + lead;
+  size_t rest = total - lead - size;
+  if (rest < ALIGNMENT) {
+    size += rest;
+    rest = 0;
+  }
+
+  /* Tags of the placed block go first, coalesce() looks at them. */
+  bt_make(placed, size, true);
+  if (lead || rest)
+    STAT(splits, 1);
+  if (lead) {
+    bt_make(block, lead, false);
+    coalesce(block);
+  }
+  if (rest) {
+    block_t *tail = (void *)placed + size;
+    bt_make(tail, rest, false);
+    coalesce(tail);
+  }
+
+  return &placed->ptr_prev;
+}
+
+static void *heap_memalign(size_t alignment, size_t size) {
+  STAT(mallocs, 1);
+  if (alignment <= ALIGNMENT)
+    return heap_malloc(size);
+  return heap_place(size, alignment, alignment);
+}
+
+static inline void *memalign_ptr(size_t alignment, size_t size) {
+  if (alignment & (alignment - 1)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (size > MAX_REQUEST)
+    return NULL;
+  if (!(heap = heap_for(size)))
+    return NULL;
+#ifdef THREADS
+  bool contended = heap_lock();
+  heap->stats.mallocs++;
+  void *ptr = heap_memalign(alignment, size);
+  heap_unlock();
+  heap_cool(contended);
+  return ptr;
+#else
+  return heap_memalign(alignment, size);
+#endif
+}
+
+void *memalign(size_t alignment, size_t size) {
+  event_begin();
+  void *ptr = memalign_ptr(alignment, size);
+  event_end(MM_EV_MEMALIGN, ptr, alignment, size);
+  return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (!alignment || alignment % sizeof(void *) ||
+      (alignment & (alignment - 1)))
+    return EINVAL;
+  void *ptr = memalign(alignment, size);
+  if (!ptr)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+/* Like glibc, any power of two goes and size need not be a multiple. */
+void *aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+void *mm_malloc_cacheline(size_t size) {
+  return memalign(CACHE_LINE, size);
+}
+
+/* --=[ realloc ]=---------------------------------------------------------- */
+
+/* Grows used block in place to want bytes, or at least to need bytes. It
+ * takes the free block after it, and grows the heap if that leaves it the
+ * last one. Returns false and leaves the block alone if need is out of
+ * reach. */
+static bool block_grow(block_t *block, size_t need, size_t want) {
+  size_t size = bt_size(block);
+  if (size >= want)
+    return true;
+
+  block_t *next = bt_next(block);
+  bool next_free = next != NULL && !bt_used(next);
+  bool last = next == NULL || (next_free && bt_next(next) == NULL);
+  size_t avail = next_free ? size + bt_size(next) : size;
+
+  if (last && avail < want) {
+    if ((long)increase(want - avail) > 0)
+      avail = want;
+    else if (avail < need && (long)increase(need - avail) > 0)
+      avail = need;
+  }
+  if (avail < need)
+    return false;
+
+  if (next_free)
+    remove_block(next);
+  size = avail < want ? avail : want;
+  if (avail - size >= ALIGNMENT)
+    set_block_free((void *)block + size, avail - size);
+  else
+    size = avail;
+  bt_make(block, size, true);
+  return true;
+}
+
+/* Gives the tail of used block past size back to the free lists. */
+static void block_shrink(block_t *block, size_t size) {
+  size_t csize = bt_size(block);
+  if (csize - size < ALIGNMENT)
+    return;
+  bt_make(block, size, true);
+  block_t *tail = (void *)block + size;
+  bt_make(tail, csize - size, false);
+  coalesce(tail);
+}
+
+static inline void *try_expand(block_t *block, size_t size) {
+  size = round_up(size + tags_size);
+  return block_grow(block, size, size) ? block : NULL;
+}
+
+static inline void *realloc_ptr(void *old_ptr, size_t size) {
+  /* If size == 0 then this is just free, and we return NULL. */
+  if (size == 0) {
+    free(old_ptr);
+    return NULL;
+  }
+
+  /* If old_ptr is NULL, then this is just malloc. */
+  if (!old_ptr)
+    return malloc(size);
+
+  if (size > MAX_REQUEST)
+    return NULL;
+
+#if defined(THREADS) || defined(LIFETIME)
+  /* Growing into the slack of the block needs no lock, and a bumped block
+   * stays in its chunk. Otherwise try_expand() finds it fits first thing. */
+  if (mm_usable_size(old_ptr) >= size) {
+    STAT_RELAXED(heap_of(old_ptr), reallocs_inplace, 1);
+    event_path(MM_PATH_INPLACE);
+    return old_ptr;
+  }
+#endif
+
+#ifdef LIFETIME
+  /* A bumped block can not grow, it moves out of its chunk. */
+  if (mm_block_hint(old_ptr) == MM_HINT_SHORT) {
+    void *new_ptr = malloc(size);
+    if (new_ptr) {
+      STAT_RELAXED(heap_of(old_ptr), reallocs_moved, 1);
+      STAT_RELAXED(heap_of(old_ptr), bytes_copied, mm_usable_size(old_ptr));
+      memcpy(new_ptr, old_ptr, mm_usable_size(old_ptr));
+      free(old_ptr);
+      event_path(MM_PATH_MOVE);
+    }
+    return new_ptr;
+  }
+#endif
+
+  /* The block stays in its heap, even if that is another thread's. */
+  heap = heap_of(old_ptr);
+  heap_lock();
+
+  // Próba rozszerzenia już zaalokowanej pamięci
   void *new_ptr = try_expand(old_ptr - footer_size, size);
   if (new_ptr != NULL) {
+    STAT(reallocs_inplace, 1);
+    event_path(MM_PATH_INPLACE);
+    heap_unlock();
     return new_ptr + footer_size;
   }
 
-  new_ptr = malloc(size);
+  new_ptr = heap_malloc(size);
 
   /* If malloc() fails, the original block is left untouched. */
-  if (!new_ptr)
+  if (!new_ptr) {
+    heap_unlock();
     return NULL;
+  }
 
   /* Copy the old data. */
   block_t *block = old_ptr - footer_size;
@@ -435,16 +2324,63 @@ void *realloc(void *old_ptr, size_t size) {
   if (size < old_size)
     old_size = size;
   memcpy(new_ptr, old_ptr, old_size);
+  STAT(reallocs_moved, 1);
+  STAT(bytes_copied, old_size);
+  event_path(MM_PATH_MOVE);
   // old_size >>= 2;
   // for(uint32_t i = 0; i < old_size; i++){
   //   ((word_t*)new_ptr)[i] = ((word_t*)old_ptr)[i];
   // }
   /* Free the old block. */
-  free(old_ptr);
+  heap_free(old_ptr);
+  heap_unlock();
+
+  return new_ptr;
+}
 
+void *realloc(void *old_ptr, size_t size) {
+  event_begin();
+  void *new_ptr = realloc_ptr(old_ptr, size);
+  event_end(MM_EV_REALLOC, new_ptr, (uintptr_t)old_ptr, size);
   return new_ptr;
 }
 
+/* --=[ resize in place ]=-------------------------------------------------- */
+
+static inline size_t resize_ptr(void *ptr, size_t min, size_t desired) {
+  /* Bigger ones can not be had anyway, and would wrap around below. */
+  min = min < MAX_REQUEST ? min : MAX_REQUEST;
+  desired = desired < MAX_REQUEST ? desired : MAX_REQUEST;
+  if (desired < min)
+    desired = min;
+  if (mm_block_hint(ptr) == MM_HINT_SHORT)
+    return mm_usable_size(ptr);
+
+  heap = heap_of(ptr);
+  heap_lock();
+#ifdef SIDE_INDEX
+  index_reserve();
+#endif
+  block_t *block = ptr - footer_size;
+  size_t want = round_up(tags_size + desired);
+  if (want < bt_size(block))
+    block_shrink(block, want);
+  else
+    block_grow(block, round_up(tags_size + min), want);
+  size_t size = bt_size(block) - tags_size;
+  heap_unlock();
+
+  return size;
+}
+
+size_t mm_resize_inplace(void *ptr, size_t min, size_t desired) {
+  event_begin();
+  event_path(MM_PATH_INPLACE);
+  size_t size = resize_ptr(ptr, min, desired);
+  event_end(MM_EV_RESIZE, ptr, (uintptr_t)ptr, size);
+  return size;
+}
+
 /* --=[ calloc ]=----------------------------------------------------------- */
 
 void *calloc(size_t nmemb, size_t size) {
@@ -455,7 +2391,523 @@ void *calloc(size_t nmemb, size_t size) {
   return new_ptr;
 }
 
+/* --=[ block sizes ]=------------------------------------------------------ */
+
+size_t mm_usable_size(void *ptr) {
+  if (ptr == NULL)
+    return 0;
+  block_t *block = ptr - footer_size;
+  return bt_size(block) - tags_size;
+}
+
+/* Mirrors the rounding malloc() does before it looks for a block. */
+size_t mm_good_size(size_t size) {
+  size = round_up(tags_size + size);
+  __unused int k = size_class(size);
+#ifdef CPU_CACHE
+  cpu_cache_t *cache = cache_get();
+  if (cache && k < cache->nclasses)
+    size = class_size[k];
+#endif
+#ifdef CLASS_LOCKS
+  if (class_size[k] <= FRONT_MAX)
+    size = class_size[k];
+#endif
+  return size - tags_size;
+}
+
+/* Coalescing reads the header anyway, so the size is only checked, and only
+ * with CHECKHEAP. */
+/* The size can not stand in for the header: a block may hold more than it
+ * was asked for, and coalescing needs its real size and flags. So it is
+ * only checked, when the heap is being debugged. */
+void mm_free_sized(void *ptr, size_t size) {
+#if defined(CHECKHEAP) || defined(DEBUG)
+  if (ptr && mm_usable_size(ptr) < size) {
+    fprintf(stderr, "mm_free_sized: block %p holds %zu bytes, not %zu\n",
+            ptr, mm_usable_size(ptr), size);
+    abort();
+  }
+#endif
+  free(ptr);
+}
+
+/* --=[ arenas ]=----------------------------------------------------------- */
+
+/* An arena lives at the start of its first chunk. Objects are bumped out of
+ * the current chunk, when it runs out a new one is taken from malloc. Big
+ * objects get a chunk of their own, so the current one is not abandoned
+ * early. Every chunk but the first is on arena->chunks. */
+#define ARENA_CHUNK 8192
+#define ARENA_MIN 256
+/* Biggest object or chunk size that can be rounded up and given a chunk
+ * header without wrapping around. */
+#define ARENA_MAX (SIZE_MAX - ALIGNMENT - sizeof(arena_chunk_t))
+
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+} arena_chunk_t;
+
+struct mm_arena {
+  arena_chunk_t *chunks;
+  void *cur; /* first free byte of the current chunk */
+  void *end; /* end of the current chunk */
+  size_t chunk_size;
+};
+
+static void *arena_chunk(mm_arena_t *arena, size_t size) {
+  arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + size);
+  if (!chunk)
+    return NULL;
+  chunk->size = size;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  return chunk + 1;
+}
+
+mm_arena_t *mm_arena_create(size_t chunk_size) {
+  if (chunk_size > ARENA_MAX)
+    return NULL;
+  chunk_size = round_up(chunk_size ? chunk_size : ARENA_CHUNK);
+  if (chunk_size < ARENA_MIN)
+    chunk_size = ARENA_MIN;
+
+  mm_arena_t *arena = malloc(chunk_size);
+  if (!arena)
+    return NULL;
+  arena->chunks = NULL;
+  arena->chunk_size = chunk_size;
+  arena->cur = arena + 1;
+  arena->end = (void *)arena + chunk_size;
+  return arena;
+}
+
+void *mm_arena_alloc(mm_arena_t *arena, size_t size) {
+  if (size > ARENA_MAX)
+    return NULL;
+  size = size ? round_up(size) : ALIGNMENT;
+  void *ptr = arena->cur;
+  if (size <= (size_t)(arena->end - ptr)) {
+    arena->cur = ptr + size;
+    return ptr;
+  }
+
+  size_t chunk_size = arena->chunk_size - sizeof(arena_chunk_t);
+  if (size > chunk_size / 4)
+    return arena_chunk(arena, size);
+  if (!(ptr = arena_chunk(arena, chunk_size)))
+    return NULL;
+  arena->cur = ptr + size;
+  arena->end = ptr + chunk_size;
+  return ptr;
+}
+
+void mm_arena_reset(mm_arena_t *arena) {
+  for (arena_chunk_t *chunk = arena->chunks, *next; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  arena->chunks = NULL;
+  arena->cur = arena + 1;
+  arena->end = (void *)arena + arena->chunk_size;
+}
+
+void mm_arena_destroy(mm_arena_t *arena) {
+  if (!arena)
+    return;
+  mm_arena_reset(arena);
+  free(arena);
+}
+
+/* --=[ handles ]=---------------------------------------------------------- */
+
+/* A handle is a slot of the handle table holding the address of its
+ * object. The table grows in a memlib region of its own and never moves.
+ * Free slots are linked by index + 1 through heap 0, under its add_lock.
+ *
+ * Handle blocks are tagged HANDLE and start with a pointer back to their
+ * slot, the object follows at the next ALIGNMENT boundary. mm_compact()
+ * walks the heap and slides each handle block that follows a free one down
+ * over it, so free space gathers at the end of the heap, where it is given
+ * back to memlib. */
+struct mm_handle {
+  union {
+    void *ptr;     /* object of a handle in use */
+    uint32_t next; /* next free slot + 1 */
+  };
+};
+
+static inline mm_handle_t handle_at(uint32_t i) {
+  return (mm_handle_t)mem_region_lo(HANDLE_REGION) + i;
+}
+
+static mm_handle_t handle_get(void) {
+  heap_t *heap0 = heap_get(0);
+  mm_handle_t h;
+#ifdef THREADS
+  pthread_mutex_lock(&heap0->add_lock);
+#endif
+  if (heap0->hfree) {
+    h = handle_at(heap0->hfree - 1);
+    heap0->hfree = h->next;
+  } else {
+    h = mem_region_sbrk(HANDLE_REGION, sizeof(struct mm_handle));
+    if ((long)h < 0)
+      h = NULL;
+  }
+#ifdef THREADS
+  pthread_mutex_unlock(&heap0->add_lock);
+#endif
+  return h;
+}
+
+static void handle_put(mm_handle_t h) {
+  heap_t *heap0 = heap_get(0);
+#ifdef THREADS
+  pthread_mutex_lock(&heap0->add_lock);
+#endif
+  h->next = heap0->hfree;
+  heap0->hfree = h - handle_at(0) + 1;
+#ifdef THREADS
+  pthread_mutex_unlock(&heap0->add_lock);
+#endif
+}
+
+mm_handle_t mm_halloc(size_t size) {
+  /* The handle word in front must not wrap the size around. */
+  if (size > MAX_REQUEST - ALIGNMENT)
+    return NULL;
+  mm_handle_t h = handle_get();
+  if (!h)
+    return NULL;
+  /* Short-lived blocks are bumped out of chunks and could not move. */
+  void *ptr = mm_malloc_hint(size + ALIGNMENT, MM_HINT_LONG);
+  if (!ptr) {
+    handle_put(h);
+    return NULL;
+  }
+  block_t *block = ptr - footer_size;
+  bt_make(block, bt_size(block), USED | HANDLE);
+  *(mm_handle_t *)ptr = h;
+  h->ptr = ptr + ALIGNMENT;
+  return h;
+}
+
+void *mm_hderef(mm_handle_t h) {
+  return h ? h->ptr : NULL;
+}
+
+void mm_hfree(mm_handle_t h) {
+  if (!h)
+    return;
+  void *ptr = h->ptr - ALIGNMENT;
+  block_t *block = ptr - footer_size;
+  /* Caches may hand the block out again to malloc. */
+  bt_make(block, bt_size(block), USED);
+  free(ptr);
+  handle_put(h);
+}
+
+/* Moves handle block over the free block right before it. Returns the
+ * free block left behind, coalesced with whatever follows. */
+static block_t *compact_slide(block_t *hole, block_t *block) {
+  size_t gap = bt_size(hole);
+  size_t size = bt_size(block);
+  remove_block(hole);
+  memmove(hole, block, size);
+  check_made(hole, size);
+  void *ptr = bt_payload((word_t *)hole);
+  (*(mm_handle_t *)ptr)->ptr = ptr + ALIGNMENT;
+  block = (void *)hole + size;
+  bt_make(block, gap, false);
+  return coalesce(block);
+}
+
+/* One step on the current heap, called with the lock held. A step that
+ * started halfway wraps around once, so 0 means a whole pass found
+ * nothing to move.
+ *
+ * The block the last step stopped at may have been merged away since, and
+ * keeping track of that would cost every remove_block(). So the step walks
+ * the headers from the first block up to where the last one stopped. */
+static size_t heap_compact(size_t budget) {
+  block_t *first = bt_next((block_t *)heap_listp);
+  block_t *block = first;
+  while (block && (void *)block - heap_listp < heap->compact)
+    block = bt_next(block);
+  bool wrap = block != first;
+  size_t moved = 0;
+
+  while (moved < budget) {
+    if (!block) {
+      if (!wrap)
+        break;
+      wrap = false;
+      block = first;
+      continue;
+    }
+    block_t *next = bt_next(block);
+    if (bt_used(block)) {
+      block = next;
+    } else if (next && (get_header(next) & HANDLE)) {
+      moved += bt_size(next);
+      block = compact_slide(block, next);
+    } else if (!next) {
+      /* Free space at the end goes back to memlib. */
+      size_t size = bt_size(block);
+      remove_block(block);
+      heap->high -= size;
+      mem_region_trim(heap->id, size);
+      block = NULL;
+    } else {
+      block = next;
+    }
+  }
+
+  heap->compact = block ? (void *)block - heap_listp : 0;
+  return moved;
+}
+
+size_t mm_compact(size_t budget) {
+  heap_t *home = heap_for(0);
+  if (!home)
+    return 0;
+  size_t moved = 0;
+#ifdef LARGE_HEAPS
+  heap_t *large = home->large;
+#endif
+  heap = home;
+  heap_lock();
+#ifdef SIDE_INDEX
+  index_reserve();
+#endif
+  moved += heap_compact(budget);
+  heap_unlock();
+#ifdef LARGE_HEAPS
+  if (large && moved < budget) {
+    heap = large;
+    heap_lock();
+#ifdef SIDE_INDEX
+    index_reserve();
+#endif
+    moved += heap_compact(budget - moved);
+    heap_unlock();
+  }
+#endif
+  return moved;
+}
+
+/* --=[ statistics ]=------------------------------------------------------- */
+
+#if NCLASSES > MM_STATS_CLASSES
+#error "mm_stats_t has no room for every size class"
+#endif
+
+#ifdef STATS
+#define COUNTER(name) __atomic_load_n(&heap->counters.name, __ATOMIC_RELAXED)
+
+/* Adds the counters of the current heap to sum. They are read without the
+ * heap lock, so a sum taken while other threads run may be a little off. */
+static void heap_counters(mm_counters_t *sum) {
+  sum->mallocs += COUNTER(mallocs);
+  sum->frees += COUNTER(frees);
+  sum->reallocs_inplace += COUNTER(reallocs_inplace);
+  sum->reallocs_moved += COUNTER(reallocs_moved);
+  sum->bytes_copied += COUNTER(bytes_copied);
+  sum->fit_probes += COUNTER(fit_probes);
+  sum->splits += COUNTER(splits);
+  for (int i = 0; i < 4; i++)
+    sum->coalesce[i] += COUNTER(coalesce[i]);
+  sum->extensions += COUNTER(extensions);
+  sum->extended_bytes += COUNTER(extended_bytes);
+}
+#endif
+
+/* Adds the free lists of the current heap to stats. */
+static void heap_stats(mm_stats_t *stats) {
+  for (int k = 0; k < NCLASSES; k++) {
+    uint32_t b = heap->free_list[k];
+    for (; b; b = get_ptr_next(heap_listp + b)) {
+      block_t *block = heap_listp + b;
+      size_t size = bt_size(block);
+      stats->free_blocks++;
+      stats->free_bytes += size;
+      stats->class_free[k] += size;
+      if (size > stats->largest_free)
+        stats->largest_free = size;
+    }
+  }
+}
+
+/* Walks the free lists of every heap, one heap locked at a time, after
+ * freeing its remote queue. The locks taken here are not counted in
+ * mm_heap_stats(). */
+int mm_stats(mm_stats_t *stats) {
+  memset(stats, 0, sizeof(mm_stats_t));
+  stats->nclasses = NCLASSES;
+  for (int k = 0; k < NCLASSES; k++)
+    stats->class_size[k] = class_size[k];
+
+  for (int i = 0; i < NREGIONS; i++) {
+    if (!mem_region_size(i))
+      continue;
+    heap = heap_get(i);
+#ifdef STATS
+    heap_counters(&stats->counters);
+#endif
+    heap_lock_quiet();
+#ifdef THREADS
+    remote_drain();
+#endif
+    heap_stats(stats);
+    heap_unlock();
+  }
+#ifdef STATS
+  return 0;
+#else
+  return -1;
+#endif
+}
+
 /* --=[ mm_checkheap ]=----------------------------------------------------- */
 
+/* A broken heap can not be trusted with anything, so the first problem
+ * found ends the program. */
+static void check_fail(void *block, const char *what) {
+  fprintf(stderr, "mm_checkheap: heap %d, block at %p: %s\n", heap->id,
+          block, what);
+  abort();
+}
+
+/* Free list node at offset, which must be a free block of class k. */
+static block_t *check_node(uint32_t offset, int k) {
+  block_t *node = heap_listp + offset;
+  if ((size_t)node + ALIGNMENT > heap->high ||
+      ((size_t)node + footer_size) % ALIGNMENT)
+    check_fail(node, "free list link points outside the heap");
+  if (bt_used(node))
+    check_fail(node, "used block on a free list");
+  size_t size = bt_size(node);
+  if (size_class(size) != k)
+    check_fail(node, "free block on the list of another class");
+  return node;
+}
+
+/* Checks the tags of a block and, if it is free, that it has no free
+ * neighbours and that its list links point back at it. Bumped blocks live
+ * inside a chunk, only the chunk itself is checked. */
+static void check_block(block_t *block) {
+  block_t *prologue = heap_listp;
+  size_t prologue_size = bt_size(prologue);
+  if ((void *)block < heap_listp + prologue_size ||
+      (size_t)block + ALIGNMENT > heap->high ||
+      ((size_t)block + footer_size) % ALIGNMENT)
+    check_fail(block, "block outside the heap or misaligned");
+  if (get_header(block) & BUMP)
+    return;
+  size_t size = bt_size(block);
+  if (size < ALIGNMENT || size % ALIGNMENT ||
+      (size_t)block + size > heap->high)
+    check_fail(block, "bad block size");
+  if (*(word_t *)bt_footer(block) != get_header(block))
+    check_fail(block, "header and footer differ");
+  if (bt_used(block))
+    return;
+
+  block_t *next = bt_next(block);
+  if (bt_free((word_t *)block - 1) || (next && !bt_used(next)))
+    check_fail(block, "free block next to a free block");
+
+  int k = size_class(size);
+  uint32_t offset = (void *)block - heap_listp;
+  uint32_t prev_free = get_ptr_prev(block);
+  uint32_t next_free = get_ptr_next(block);
+  if (!(heap->nonempty & (1UL << k)))
+    check_fail(block, "free block in a class marked empty");
+  if (prev_free ? get_ptr_next(check_node(prev_free, k)) != offset
+                : heap->free_list[k] != offset)
+    check_fail(block, "free block not linked from its list");
+  if (next_free && get_ptr_prev(check_node(next_free, k)) != offset)
+    check_fail(block, "next free block does not link back");
+}
+
+/* Walks all blocks, then all free lists, and checks that both find the
+ * same free blocks. */
+static void check_heap(void) {
+  block_t *prologue = heap_listp;
+  size_t nfree = 0;
+
+  block_t *block = heap_listp + bt_size(prologue);
+  while ((size_t)block < heap->high) {
+    check_block(block);
+    if (!bt_used(block))
+      nfree++;
+    block = (void *)block + bt_size(block);
+  }
+
+  for (int k = 0; k < NCLASSES; k++) {
+    uint32_t prev = 0;
+    if (!heap->free_list[k] != !(heap->nonempty & (1UL << k)))
+      check_fail(heap, "nonempty bit does not match the free list");
+    for (uint32_t b = heap->free_list[k]; b; b = get_ptr_next(block)) {
+      block = check_node(b, k);
+      if (get_ptr_prev(block) != prev)
+        check_fail(block, "free block does not link back");
+      if (nfree-- == 0)
+        check_fail(block, "more blocks on the free lists than free blocks");
+      prev = b;
+    }
+  }
+  if (nfree)
+    check_fail(heap, "free block missing from the free lists");
+
+#ifdef SIDE_INDEX
+  if (heap->idx_valid) {
+    for (uint32_t i = 0; i < heap->idx_count; i++) {
+      block = heap_listp + idx_offs()[i];
+      size_t size = bt_size(block);
+      if (bt_used(block) || size_class(size) < FIRST_RANGE_CLASS ||
+          idx_sizes()[i] != size || block->footer != i)
+        check_fail(block, "side index entry does not match the block");
+    }
+  }
+#endif
+}
+
+#ifdef CHECKHEAP
+/* Blocks the heap moved past since they changed are gone. */
+static void check_dirty(void) {
+  for (uint32_t i = 0; i < heap->ndirty; i++) {
+    block_t *block = heap_listp + heap->dirty[i];
+    if ((size_t)block < heap->high)
+      check_block(block);
+  }
+}
+#endif
+
+/* Checks every heap, the whole of it the first time and when too many
+ * blocks changed since the last call, else only the changed blocks. With
+ * verbose > 1 it is always the whole heap. */
 void mm_checkheap(int verbose) {
+  for (int i = 0; i < NREGIONS; i++) {
+    if (!mem_region_size(i))
+      continue;
+    heap = heap_get(i);
+    heap_lock();
+#ifdef THREADS
+    /* Queued blocks are still marked used, the check would miss them. */
+    remote_drain();
+#endif
+#ifdef CHECKHEAP
+    if (verbose > 1 || heap->ndirty > DIRTY_MAX)
+      check_heap();
+    else
+      check_dirty();
+    heap->ndirty = 0;
+#else
+    check_heap();
+#endif
+    heap_unlock();
+  }
 }
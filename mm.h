@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef DRIVER
@@ -7,6 +8,9 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
 
 #else
 
@@ -15,11 +19,182 @@ extern void *malloc(size_t size);
 extern void free(void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
 
 #endif
 
 extern int mm_init(void);
 
+/* Expected lifetime of a block, short-lived ones are freed within
+ * MM_SHORT_LIFE mallocs. */
+enum { MM_HINT_UNKNOWN, MM_HINT_SHORT, MM_HINT_LONG };
+#define MM_SHORT_LIFE 16
+
+/* Like malloc, short-lived blocks may be kept apart from the others. With
+ * MM_HINT_UNKNOWN the allocator predicts the lifetime itself. */
+extern void *mm_malloc_hint(size_t size, int hint);
+/* MM_HINT_SHORT if the block at ptr was placed as short-lived, else
+ * MM_HINT_LONG. */
+extern int mm_block_hint(void *ptr);
+
+/* Like malloc, but the payload starts at a 64-byte cache line. */
+extern void *mm_malloc_cacheline(size_t size);
+
+/* Bytes the block at ptr can hold, at least what was asked for. */
+extern size_t mm_usable_size(void *ptr);
+/* Usable size a malloc of size bytes is going to get. */
+extern size_t mm_good_size(size_t size);
+/* Like free, size is what the block was allocated or reallocated with.
+ * mm.c only checks it, built with CHECKHEAP or DEBUG. */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/* Resizes the block at ptr without moving it: to desired bytes if it can,
+ * else to at least min. Returns the usable size it ends up with, which is
+ * below min if the block could not grow enough and was left as it was. */
+extern size_t mm_resize_inplace(void *ptr, size_t min, size_t desired);
+
+/* Allocates n blocks of given size into out, carved from as few free
+ * blocks as possible. Returns how many it got, less than n only if out of
+ * memory. */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+/* Frees n blocks, NULL entries are skipped. Sorts ptrs in place. */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Movable objects, reached through a handle that stays put. An object is
+ * mm_hderef()'ed again after each mm_compact(), which may move it. */
+typedef struct mm_handle *mm_handle_t;
+
+/* Returns NULL if out of memory. */
+extern mm_handle_t mm_halloc(size_t size);
+extern void *mm_hderef(mm_handle_t h);
+extern void mm_hfree(mm_handle_t h);
+/* Moves objects toward the start of the heap of the calling thread, until
+ * budget bytes are moved or the end of the heap is reached, and gives free
+ * space at the end back to memlib. Returns bytes moved, 0 once there is
+ * nothing left to move. */
+extern size_t mm_compact(size_t budget);
+
+/* Bump allocator for objects that all die together. Its chunks come from
+ * malloc and go back on reset and destroy, objects are never freed one by
+ * one. An arena must not be used by two threads at once. */
+typedef struct mm_arena mm_arena_t;
+
+/* chunk_size of 0 picks the default. Returns NULL if out of memory. */
+extern mm_arena_t *mm_arena_create(size_t chunk_size);
+extern void *mm_arena_alloc(mm_arena_t *arena, size_t size);
+/* Frees all objects of the arena, it keeps its first chunk for reuse. */
+extern void mm_arena_reset(mm_arena_t *arena);
+extern void mm_arena_destroy(mm_arena_t *arena);
+
+/* Event counters kept by every heap when mm.c is built with STATS. */
+typedef struct {
+  unsigned long mallocs;          /* blocks handed out by the heaps */
+  unsigned long frees;            /* blocks given back to them */
+  unsigned long reallocs_inplace; /* reallocs that kept the block... */
+  unsigned long reallocs_moved;   /* ... and those that had to copy it */
+  unsigned long bytes_copied;     /* by the latter */
+  unsigned long fit_probes;       /* free blocks looked at to find a fit */
+  unsigned long splits;           /* fits that left a free remainder */
+  unsigned long coalesce[4];      /* merges with: none, next, prev, both */
+  unsigned long extensions;       /* times a heap grew... */
+  unsigned long extended_bytes;   /* ... and by how much in total */
+} mm_counters_t;
+
+#define MM_STATS_CLASSES 64
+
+/* Counters summed over all heaps, and their free space as it is now. */
+typedef struct {
+  mm_counters_t counters;
+  unsigned long free_blocks;
+  unsigned long free_bytes;
+  unsigned long largest_free;
+  unsigned nclasses;                          /* size classes of mm... */
+  unsigned long class_size[MM_STATS_CLASSES]; /* ... the largest size of each */
+  unsigned long class_free[MM_STATS_CLASSES]; /* free bytes on its list */
+} mm_stats_t;
+
+/* Fills in stats, returns -1 if mm.c was built without STATS and only the
+ * free space figures are there. */
+extern int mm_stats(mm_stats_t *stats);
+
+/* Calls into the allocator, recorded when mm.c is built with EVENTS. */
+enum {
+  MM_EV_MALLOC = 1, /* also each block of a batch */
+  MM_EV_FREE,       /* ditto */
+  MM_EV_REALLOC,
+  MM_EV_MEMALIGN,
+  MM_EV_RESIZE, /* mm_resize_inplace(), size is what the block got */
+};
+
+/* Where the block of a call came from or went to. */
+enum {
+  MM_PATH_NONE,
+  MM_PATH_FIT,     /* free list */
+  MM_PATH_EXTEND,  /* heap grown for it */
+  MM_PATH_CACHE,   /* per-CPU cache */
+  MM_PATH_FRONT,   /* class front */
+  MM_PATH_BUMP,    /* chunk of short-lived blocks */
+  MM_PATH_HEAP,    /* freed into its heap */
+  MM_PATH_REMOTE,  /* freed onto the remote queue of its heap */
+  MM_PATH_INPLACE, /* realloc kept the block */
+  MM_PATH_MOVE,    /* realloc copied it */
+};
+
+typedef struct {
+  uint64_t time;   /* TSC when the call started */
+  uint64_t ptr;    /* block returned, or freed */
+  uint64_t arg;    /* realloc: the old block, memalign: the alignment */
+  uint64_t size;   /* bytes asked for */
+  uint32_t ticks;  /* TSC ticks the call took */
+  uint16_t probes; /* free blocks it looked at */
+  uint8_t op;
+  uint8_t path;
+} mm_event_t;
+
+/* A dump starts with MM_EVENTS_MAGIC and sizeof(mm_event_t), both as
+ * uint32_t. Then for each thread come its number and how many events
+ * follow, as uint32_t, and its events, oldest first. ./decode-events.py
+ * turns a dump into a trace for mdriver. */
+#define MM_EVENTS_MAGIC 0x56454d4d /* "MMEV" */
+
+/* Writes the last events of every thread that called the allocator since
+ * mm_init() to path. Safe to call from a signal handler. Returns -1 on
+ * error, or if mm.c was built without EVENTS. */
+extern int mm_events_dump(const char *path);
+/* Calls mm_events_dump(path) whenever signal sig arrives, path must stay
+ * valid. Returns -1 on error. */
+extern int mm_events_on_signal(int sig, const char *path);
+
+#ifdef THREADS
+/* Per heap counters of the thread-safe build. */
+typedef struct {
+  unsigned long mallocs;      /* mallocs served by the heap */
+  unsigned long frees;        /* frees done under its lock */
+  unsigned long remote_frees; /* frees left on its remote queue */
+  unsigned long locks;        /* times its lock was taken */
+  unsigned long contended;    /* ... and had to be waited for */
+  unsigned long wait_ns;      /* time spent waiting */
+  unsigned threads;           /* threads assigned to it */
+} mm_heap_stats_t;
+
+/* Fills in stats of heap i, returns -1 if there is no such heap. */
+extern int mm_heap_stats(int i, mm_heap_stats_t *stats);
+
+/* Lock counters of one size class list, built with CLASS_LOCKS. Lock-free
+ * classes count operations and failed exchanges and never wait. */
+typedef struct {
+  unsigned long locks;      /* acquisitions */
+  unsigned long contended;  /* ... that had to wait */
+  unsigned long wait_ticks; /* time waiting, in TSC ticks */
+  unsigned long hold_ticks; /* time holding the lock */
+} mm_lock_stats_t;
+
+/* Fills in stats of class k in heap i, returns -1 if there are none. */
+extern int mm_class_stats(int i, int k, mm_lock_stats_t *stats);
+#endif
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);